@@ -9,6 +9,7 @@ void Chunk::clear() {
   FREE_ARRAY(uint8_t, code, capacity);
   FREE_ARRAY(int, lines, capacity);
   constants.clear();
+  jump_targets.clear();
   count = 0;
   capacity = 0;
   code = nullptr;
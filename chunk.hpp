@@ -6,6 +6,7 @@
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
@@ -17,9 +18,14 @@ typedef enum {
   OP_SET_GLOBAL,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_GET_CAPTURE,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
+  OP_GET_FIELD,
+  OP_SET_FIELD,
   OP_GET_SUPER,
+  OP_GET_METHOD,
+  OP_GET_SUPER_METHOD,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -29,21 +35,48 @@ typedef enum {
   OP_DIVIDE,
   OP_INT_DIVIDE,
   OP_POW,
+  OP_BIT_AND,
+  OP_BIT_OR,
+  OP_BIT_XOR,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
   OP_NOT,
   OP_NEGATE,
+  OP_BIT_NOT,
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_LONG,
+  OP_JUMP_IF_FALSE_LONG,
+  OP_SWITCH_TABLE,
+  OP_SWITCH_MAP,
   OP_LOOP,
+  OP_LOOP_LONG,
+  OP_FOR_PREP,
+  OP_FOR_RANGE,
+  OP_FOR_RANGE_LONG,
+  OP_ITER_INIT,
+  OP_ITER_NEXT,
+  OP_ITER_NEXT_LONG,
+  OP_ITER_VALUE,
+  OP_ITER_VALUE_LONG,
   OP_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  OP_CALL_METHOD,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  OP_FIELD,
+  OP_BUILD_LIST,
+  OP_EXTEND_LIST,
+  OP_BUILD_MAP,
+  OP_EXTEND_MAP,
+  OP_BUILD_STRING,
+  OP_WIDE
 } Op_code;
 
 struct Chunk {
@@ -52,6 +85,9 @@ struct Chunk {
   uint8_t* code;
   int* lines;
   ValueArray constants;
+  // Offsets that long forward jumps go to. It only holds the jumps too long 
+  // for a 16-bit operand, and jumps to the same place share an entry.
+  ValueArray jump_targets;
 
   Chunk();
   void clear();
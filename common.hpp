@@ -12,6 +12,16 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// Marks the old generation in a forked process (POSIX only). Only the forking 
+// thread exists in the child, so this assumes the host program doesn't run 
+// threads of its own.
+// #define GC_CONCURRENT_MARK
+
+// Moves objects out of sparse pages after a collection to give memory back.
+// #define GC_COMPACT
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define MAX_SAFE_INTEGER 9007199254740991
 
 #endif
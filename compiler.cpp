@@ -1,10 +1,15 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.hpp"
 #include "compiler.hpp"
+#include "map.hpp"
 #include "memory.hpp"
+#include "native.hpp"
+#include "nativeclass.hpp"
 #include "scanner.hpp"
+#include "table.hpp"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.hpp"
@@ -24,6 +29,10 @@ enum Precedence {
   PREC_AND,         
   PREC_EQUALITY,    
   PREC_COMPARISON,  
+  PREC_BIT_OR,
+  PREC_BIT_XOR,
+  PREC_BIT_AND,
+  PREC_SHIFT,
   PREC_TERM,        
   PREC_FACTOR,    
   PREC_POW,  
@@ -44,10 +53,17 @@ struct Local {
   Token name;
   int depth;
   bool is_captured;
+  bool is_assigned;
+  bool is_const;
+  bool has_value;
+  Value value;
+  // Set when the local holds the receiver of a method read rather than the 
+  // bound method itself, and the method is in the hidden slot after it.
+  bool holds_method;
 };
 
 struct Upvalue {
-  uint8_t index;
+  uint16_t index;
   bool is_local;
 };
 
@@ -63,16 +79,32 @@ struct Compiler {
   Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int local_count;
-  Upvalue upvalues[UINT8_COUNT];
+  int local_capacity;
+  Upvalue* upvalues;
+  int upvalue_capacity;
+  Upvalue* captures;
+  int capture_capacity;
   int scope_depth;
+  int property_offset;
+  int property_end;
+  int property_name;
+  bool property_super;
+  int this_end;
+  Map constant_indices;
+  Table assigned_names;
+  Table const_globals;
+  Table const_values;
+  Table class_layouts;
+  Table global_names;
 };
 
 struct ClassCompiler {
   Token name;
   ClassCompiler* enclosing;
   bool has_superclass;
+  ObjClass* layout;
 };
 
 Parser parser;
@@ -142,16 +174,57 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
   emit_byte(byte2);
 }
 
+// OP_WIDE gives the next instruction a 24-bit operand, as wide as any
+// constant index make_constant hands out.
+static void emit_indexed(uint8_t instruction, int index) {
+  if (index > 0xffffff) {
+    error("Too many constants in one chunk.");
+    return;
+  }
+  if (index > UINT8_MAX) {
+    emit_bytes(OP_WIDE, instruction);
+    emit_byte((index >> 16) & 0xff);
+    emit_bytes((index >> 8) & 0xff, index & 0xff);
+  } else {
+    emit_bytes(instruction, static_cast<uint8_t>(index));
+  }
+}
+
 static void emit_loop(int loop_start) {
-  emit_byte(OP_LOOP);
+  int offset = curr_chunk()->count - loop_start + 3;
+  if (offset <= UINT16_MAX) {
+    emit_byte(OP_LOOP);
+    emit_byte((offset >> 8) & 0xff);
+    emit_byte(offset & 0xff);
+    return;
+  }
 
-  int offset = curr_chunk()->count - loop_start + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  offset++;
+  if (offset > 0xffffff) error("Loop body too large.");
 
+  emit_byte(OP_LOOP_LONG);
+  emit_byte((offset >> 16) & 0xff);
   emit_byte((offset >> 8) & 0xff);
   emit_byte(offset & 0xff);
 }
 
+// Emits an indexed instruction, with an optional byte operand, that ends in
+// a backward offset to loop_start, switching to its long form when the 
+// offset needs 24 bits.
+static void emit_loop_instruction(uint8_t instruction, uint8_t long_instruction, int slot, int operand, int loop_start) {
+  int length = (slot > UINT8_MAX ? 5 : 2) + (operand != -1 ? 1 : 0) + 2;
+  int offset = curr_chunk()->count + length - loop_start;
+  if (offset > UINT16_MAX) {
+    instruction = long_instruction;
+    offset++;
+    if (offset > 0xffffff) error("Loop body too large.");
+  }
+  emit_indexed(instruction, slot);
+  if (operand != -1) emit_byte(static_cast<uint8_t>(operand));
+  if (instruction == long_instruction) emit_byte((offset >> 16) & 0xff);
+  emit_bytes((offset >> 8) & 0xff, offset & 0xff);
+}
+
 static int emit_jump(uint8_t instruction) {
   emit_byte(instruction);
   emit_byte(0xff);
@@ -168,34 +241,149 @@ static void emit_return() {
   emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
+static int make_constant(Value value) {
+  Value index;
+  if (curr->constant_indices.get(value, &index)) {
+    return static_cast<int>(AS_NUMBER(index));
+  }
   int constant = curr_chunk()->add_constant(value);
-  if (constant > UINT8_MAX) {
+  write_barrier(curr->function, value);
+  if (constant > 0xffffff) {
     error("Too many constants in one chunk.");
     return 0;
   }
-  return static_cast<uint8_t>(constant);
+  curr->constant_indices.set(value, NUMBER_VAL(constant));
+  return constant;
 }
 
 static void emit_constant(Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+  int constant = make_constant(value);
+  if (constant > UINT8_MAX) {
+    emit_byte(OP_CONSTANT_LONG);
+    emit_byte((constant >> 16) & 0xff);
+    emit_bytes((constant >> 8) & 0xff, constant & 0xff);
+  } else {
+    emit_bytes(OP_CONSTANT, static_cast<uint8_t>(constant));
+  }
 }
 
 static void patch_jump(int offset) {
+  // A jump landing here means the value on top of the stack may not come 
+  // from the property read or this just before it.
+  curr->property_offset = -1;
+  curr->this_end = -1;
+  uint8_t* instruction = &curr_chunk()->code[offset - 1];
+  assert(*instruction == OP_JUMP || *instruction == OP_JUMP_IF_FALSE);
   int jump = curr_chunk()->count - offset - 2;
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    // The operand has no room for the distance, and the code after it can't 
+    // move, so the jump becomes a long jump whose operand indexes the target 
+    // in the chunk's jump table.
+    *instruction = *instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG;
+    ValueArray* targets = &curr_chunk()->jump_targets;
+    Value target = INT_VAL(curr_chunk()->count);
+    jump = targets->count - 1;
+    while (jump >= 0 && targets->values[jump] != target) jump--;
+    if (jump < 0) {
+      targets->write(target);
+      jump = targets->count - 1;
+    }
+    if (jump > UINT16_MAX) error("Too much code to jump over.");
   }
   curr_chunk()->code[offset] = (jump >> 8) & 0xff;
   curr_chunk()->code[offset + 1] = jump & 0xff;
 }
 
+static Local* push_local() {
+  if (curr->local_capacity < curr->local_count + 1) {
+    int old_capacity = curr->local_capacity;
+    curr->local_capacity = GROW_CAPACITY(old_capacity);
+    curr->locals = GROW_ARRAY(Local, curr->locals, old_capacity, curr->local_capacity);
+  }
+  if (curr->local_count + 1 > curr->function->max_locals) {
+    curr->function->max_locals = curr->local_count + 1;
+  }
+  return &curr->locals[curr->local_count++];
+}
+
+static bool is_assignment(TokenType type) {
+  switch (type) {
+    case TOKEN_EQUAL:
+    case TOKEN_PLUS_EQUAL:
+    case TOKEN_MINUS_EQUAL:
+    case TOKEN_STAR_EQUAL:
+    case TOKEN_SLASH_EQUAL:
+    case TOKEN_STAR_STAR_EQUAL:
+    case TOKEN_SLASH_SLASH_EQUAL:
+    case TOKEN_AMPERSAND_EQUAL:
+    case TOKEN_PIPE_EQUAL:
+    case TOKEN_CARET_EQUAL:
+    case TOKEN_LESS_LESS_EQUAL:
+    case TOKEN_GREATER_GREATER_EQUAL:
+    case TOKEN_PLUS_PLUS:
+    case TOKEN_MINUS_MINUS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Scans ahead to the end of the function body and records every variable 
+// name that appears as an assignment target, including inside nested 
+// functions. Locals whose names are never assigned can be captured by value.
+// Globals defined more than once in a script count as assigned.
+static void collect_assigned_names() {
+  Scanner state = save_scanner();
+  int depth = 0;
+  TokenType before = TOKEN_SEMICOLON;
+  Token token = scan_token();
+  while (token.type != TOKEN_EOF) {
+    Token next = scan_token();
+    if (
+      token.type == TOKEN_IDENTIFIER && before != TOKEN_LET && before != TOKEN_CONST &&
+      before != TOKEN_DOT && is_assignment(next.type)
+    ) {
+      vm.push(OBJ_VAL(copy_string(token.start, token.length)));
+      curr->assigned_names.set(AS_STRING(vm.peek(0)), NIL_VAL);
+      vm.pop();
+    } else if (
+      token.type == TOKEN_IDENTIFIER && curr->type == TYPE_SCRIPT && depth == 0 &&
+      (before == TOKEN_LET || before == TOKEN_CONST || before == TOKEN_FN || before == TOKEN_CLASS)
+    ) {
+      Value unused;
+      vm.push(OBJ_VAL(copy_string(token.start, token.length)));
+      ObjString* name = AS_STRING(vm.peek(0));
+      if (curr->global_names.get(name, &unused)) {
+        curr->assigned_names.set(name, NIL_VAL);
+      } else {
+        curr->global_names.set(name, NIL_VAL);
+      }
+      vm.pop();
+    } else if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      if (--depth == 0 && curr->type != TYPE_SCRIPT) break;
+    }
+    before = token.type;
+    token = next;
+  }
+  restore_scanner(state);
+}
+
 static void init_compiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = curr;
   compiler->function = nullptr;
   compiler->type = type;
+  compiler->locals = nullptr;
   compiler->local_count = 0;
+  compiler->local_capacity = 0;
+  compiler->upvalues = nullptr;
+  compiler->upvalue_capacity = 0;
+  compiler->captures = nullptr;
+  compiler->capture_capacity = 0;
   compiler->scope_depth = 0;
+  compiler->property_offset = -1;
+  compiler->this_end = -1;
   compiler->function = new ObjFunction();
   curr = compiler;
   if (type == TYPE_LAMBDA) {
@@ -203,9 +391,17 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
   } else if (type != TYPE_SCRIPT) {
     curr->function->name = copy_string(parser.prev.start, parser.prev.length);
   }
-  Local* local = &curr->locals[curr->local_count++];
+  if (curr->function->name != nullptr) {
+    write_barrier(curr->function, OBJ_VAL(curr->function->name));
+  }
+  collect_assigned_names();
+  Local* local = push_local();
   local->depth = 0;
   local->is_captured = false;
+  local->is_assigned = false;
+  local->is_const = false;
+  local->has_value = false;
+  local->holds_method = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -225,6 +421,13 @@ static ObjFunction* end_compiler() {
   }
 #endif
 
+  curr->constant_indices.clear();
+  curr->assigned_names.clear();
+  curr->const_globals.clear();
+  curr->const_values.clear();
+  curr->class_layouts.clear();
+  curr->global_names.clear();
+  FREE_ARRAY(Local, curr->locals, curr->local_capacity);
   curr = curr->enclosing;
   return function;
 }
@@ -250,8 +453,10 @@ static void statement();
 static void declaration();
 static ParseRule* get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
+static void named_variable(Token name, bool can_assign);
+static Token synthetic_token(const char* text);
 
-static uint8_t identifier_constant(Token* name) {
+static int identifier_constant(Token* name) {
   return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
@@ -273,47 +478,71 @@ static int resolve_local(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
-  int upvalue_count = compiler->function->upvalue_count;
-  for (int i = 0; i < upvalue_count; i++) {
-    Upvalue* upvalue = &compiler->upvalues[i];
+static int add_upvalue(Compiler* compiler, uint16_t index, bool is_local, bool by_value) {
+  Upvalue** upvalues = by_value ? &compiler->captures : &compiler->upvalues;
+  int* capacity = by_value ? &compiler->capture_capacity : &compiler->upvalue_capacity;
+  int* count = by_value ? &compiler->function->capture_count : &compiler->function->upvalue_count;
+  for (int i = 0; i < *count; i++) {
+    Upvalue* upvalue = &(*upvalues)[i];
     if (upvalue->index == index && upvalue->is_local == is_local) {
       return i;
     }
   }
-  if (upvalue_count == UINT8_COUNT) {
+  if (*count == UINT16_COUNT) {
     error("Too many closure variables in function.");
     return 0;
   }
-  compiler->upvalues[upvalue_count].is_local = is_local;
-  compiler->upvalues[upvalue_count].index = index;
-  return compiler->function->upvalue_count++;
+  if (*capacity < *count + 1) {
+    int old_capacity = *capacity;
+    *capacity = GROW_CAPACITY(old_capacity);
+    *upvalues = GROW_ARRAY(Upvalue, *upvalues, old_capacity, *capacity);
+  }
+  (*upvalues)[*count].is_local = is_local;
+  (*upvalues)[*count].index = index;
+  return (*count)++;
 }
 
-static int resolve_upvalue(Compiler* compiler, Token* name) {
+// Locals that are never assigned are copied into the closure when it is 
+// created, so reading them needs no ObjUpvalue. by_value reports which 
+// kind of slot the returned index refers to.
+static int resolve_upvalue(Compiler* compiler, Token* name, bool* by_value) {
   if (compiler->enclosing == nullptr) return -1;
   int local = resolve_local(compiler->enclosing, name);
   if (local != -1) {
-    compiler->enclosing->locals[local].is_captured = true;
-    return add_upvalue(compiler, static_cast<uint8_t>(local), true);
+    Local* captured = &compiler->enclosing->locals[local];
+    *by_value = !captured->is_assigned;
+    if (!*by_value) captured->is_captured = true;
+    return add_upvalue(compiler, static_cast<uint16_t>(local), true, *by_value);
   }
-  int upvalue = resolve_upvalue(compiler->enclosing, name);
+  int upvalue = resolve_upvalue(compiler->enclosing, name, by_value);
   if (upvalue != -1) {
-    return add_upvalue(compiler, static_cast<uint8_t>(upvalue), false);
+    return add_upvalue(compiler, static_cast<uint16_t>(upvalue), false, *by_value);
   }
 
   return -1;
 }
 
 static void add_local(Token name) {
-  if (curr->local_count == UINT8_COUNT) {
+  if (curr->local_count == LOCALS_MAX) {
     error("Too many local variables in function.");
     return;
   }
-  Local* local = &curr->locals[curr->local_count++];
+  bool is_assigned = false;
+  if (curr->assigned_names.count > 0) {
+    Value unused;
+    vm.push(OBJ_VAL(copy_string(name.start, name.length)));
+    is_assigned = curr->assigned_names.get(AS_STRING(vm.peek(0)), &unused);
+    vm.pop();
+  }
+
+  Local* local = push_local();
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
+  local->is_assigned = is_assigned;
+  local->is_const = false;
+  local->has_value = false;
+  local->holds_method = false;
 }
 
 static void declare_variable() {
@@ -331,11 +560,56 @@ static void declare_variable() {
   add_local(*name);
 }
 
-static uint8_t parse_variable(const char* error_message) {
-  consume(TOKEN_IDENTIFIER, error_message);
+static Compiler* script_compiler() {
+  Compiler* compiler = curr;
+  while (compiler->enclosing != nullptr) compiler = compiler->enclosing;
+  return compiler;
+}
+
+static int declare_name() {
   declare_variable();
   if (curr->scope_depth > 0) return 0;
-  return identifier_constant(&parser.prev);
+  int global = identifier_constant(&parser.prev);
+  Value unused;
+  ObjString* name = AS_STRING(curr_chunk()->constants.values[global]);
+  if (script_compiler()->const_globals.get(name, &unused)) {
+    error("Already a constant with this name.");
+  }
+  return global;
+}
+
+static int parse_variable(const char* error_message) {
+  consume(TOKEN_IDENTIFIER, error_message);
+  return declare_name();
+}
+
+// Finds the innermost declaration of a name and reports whether it is a 
+// const. Consts initialized with a compile-time constant are inlined, 
+// so nested functions read them without capturing anything.
+static bool resolve_const(Token* name, Value* value, bool* has_value) {
+  Compiler* compiler = curr;
+  for (;;) {
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+      Local* local = &compiler->locals[i];
+      if (identifiers_equal(name, &local->name)) {
+        if (local->depth == -1) return false;
+        *value = local->value;
+        *has_value = local->has_value;
+        return local->is_const;
+      }
+    }
+    if (compiler->enclosing == nullptr) break;
+    compiler = compiler->enclosing;
+  }
+  if (compiler->const_globals.count == 0) return false;
+
+  Value unused;
+  vm.push(OBJ_VAL(copy_string(name->start, name->length)));
+  ObjString* string = AS_STRING(vm.peek(0));
+  bool is_const = compiler->const_globals.get(string, &unused);
+  *has_value = compiler->const_values.get(string, value);
+  vm.pop();
+  return is_const;
 }
 
 static void mark_initialized() {
@@ -343,9 +617,9 @@ static void mark_initialized() {
   curr->locals[curr->local_count - 1].depth = curr->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
   if (curr->scope_depth > 0) mark_initialized();
-  else emit_bytes(OP_DEFINE_GLOBAL, global);
+  else emit_indexed(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list() {
@@ -398,28 +672,94 @@ static void binary(bool can_assign) {
     case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
     case TOKEN_STAR_STAR:     emit_byte(OP_POW); break;
     case TOKEN_SLASH_SLASH:   emit_byte(OP_INT_DIVIDE); break;
+
+    case TOKEN_AMPERSAND:       emit_byte(OP_BIT_AND); break;
+    case TOKEN_PIPE:            emit_byte(OP_BIT_OR); break;
+    case TOKEN_CARET:           emit_byte(OP_BIT_XOR); break;
+    case TOKEN_LESS_LESS:       emit_byte(OP_SHIFT_LEFT); break;
+    case TOKEN_GREATER_GREATER: emit_byte(OP_SHIFT_RIGHT); break;
     default: return; 
   }
 }
 
+// True when the last thing compiled was a property or super method read 
+// that no jump lands after, so its bound method is only seen by whatever 
+// comes next.
+static bool property_pending() {
+  return curr->property_offset != -1 && curr->property_end == curr_chunk()->count;
+}
+
+static void emit_invoke(int name, bool is_super, uint8_t arg_count) {
+  if (is_super) {
+    named_variable(synthetic_token("super"), false);
+    emit_indexed(OP_SUPER_INVOKE, name);
+  } else {
+    emit_indexed(OP_INVOKE, name);
+  }
+  emit_byte(arg_count);
+}
+
 static void call(bool can_assign) {
+  if (property_pending()) {
+    // The callee is a property read that nothing else can observe, so the 
+    // bound method it would allocate is replaced by a direct invoke.
+    curr_chunk()->count = curr->property_offset;
+    curr->property_offset = -1;
+    int name = curr->property_name;
+    bool is_super = curr->property_super;
+    uint8_t arg_count = argument_list();
+    emit_invoke(name, is_super, arg_count);
+    return;
+  }
   uint8_t arg_count = argument_list();
   emit_bytes(OP_CALL, arg_count);
 }
 
+// Returns the slot of a field declared by the class whose method is being 
+// compiled, or -1 if the field isn't part of its layout.
+static int field_slot(Token* name) {
+  if (curr_class == nullptr || curr_class->layout == nullptr) return -1;
+  if (curr->type != TYPE_METHOD && curr->type != TYPE_INITIALIZER) return -1;
+  Value slot;
+  vm.push(OBJ_VAL(copy_string(name->start, name->length)));
+  bool found = curr_class->layout->field_slots.get(AS_STRING(vm.peek(0)), &slot);
+  vm.pop();
+  return found ? static_cast<int>(AS_NUMBER(slot)) : -1;
+}
+
 static void dot(bool can_assign) {
+  bool after_this = curr->this_end == curr_chunk()->count;
+  curr->this_end = -1;
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifier_constant(&parser.prev);
-  
+  int slot = after_this && !check(TOKEN_LEFT_PAREN) ? field_slot(&parser.prev) : -1;
+  if (slot != -1) {
+    // The receiver is this, which is always an instance of the class or of 
+    // a subclass that extends its layout, so the field is read by slot.
+    curr_chunk()->count -= 2;
+    if (can_assign && match(TOKEN_EQUAL)) {
+      expression();
+      emit_indexed(OP_SET_FIELD, slot);
+    } else {
+      emit_indexed(OP_GET_FIELD, slot);
+    }
+    return;
+  }
+
+  int name = identifier_constant(&parser.prev);
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(OP_SET_PROPERTY, name);
+    emit_indexed(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
-    emit_bytes(OP_INVOKE, name);
+    emit_indexed(OP_INVOKE, name);
     emit_byte(arg_count);
   } else {
-    emit_bytes(OP_GET_PROPERTY, name);
+    int offset = curr_chunk()->count;
+    emit_indexed(OP_GET_PROPERTY, name);
+    curr->property_offset = offset;
+    curr->property_end = curr_chunk()->count;
+    curr->property_name = name;
+    curr->property_super = false;
   }
 }
 
@@ -429,12 +769,12 @@ static void index(bool can_assign) {
  
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    uint8_t name = make_constant(OBJ_VAL(copy_string("_set", 4)));
-    emit_bytes(OP_INVOKE, name);
+    int name = make_constant(OBJ_VAL(copy_string("_set", 4)));
+    emit_indexed(OP_INVOKE, name);
     emit_byte(2);
   } else {
-    uint8_t name = make_constant(OBJ_VAL(copy_string("_get", 4)));
-    emit_bytes(OP_INVOKE, name);
+    int name = make_constant(OBJ_VAL(copy_string("_get", 4)));
+    emit_indexed(OP_INVOKE, name);
     emit_byte(1);
   }
 }
@@ -448,6 +788,42 @@ static void literal(bool can_assign) {
   }
 }
 
+// Elements are collected on the stack in batches so a long literal never 
+// holds more than UINT8_MAX of them there at once.
+static void list(bool can_assign) {
+  int count = 0;
+  bool built = false;
+  while (!check(TOKEN_RIGHT_BRACKET) && !check(TOKEN_EOF)) {
+    expression();
+    if (++count == UINT8_MAX) {
+      emit_bytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, count);
+      built = true;
+      count = 0;
+    }
+    if (!match(TOKEN_COMMA)) break;
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  if (!built || count > 0) emit_bytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, count);
+}
+
+static void map(bool can_assign) {
+  int count = 0;
+  bool built = false;
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    expression();
+    consume(TOKEN_COLON, "Expect ':' after map key.");
+    expression();
+    if (++count == UINT8_MAX) {
+      emit_bytes(built ? OP_EXTEND_MAP : OP_BUILD_MAP, count);
+      built = true;
+      count = 0;
+    }
+    if (!match(TOKEN_COMMA)) break;
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  if (!built || count > 0) emit_bytes(built ? OP_EXTEND_MAP : OP_BUILD_MAP, count);
+}
+
 static void grouping(bool can_assign) {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
@@ -472,14 +848,62 @@ static void string(bool can_assign) {
   emit_constant(OBJ_VAL(copy_string(parser.prev.start + 1, parser.prev.length - 2)));
 }
 
+// The first and middle parts of an interpolated string arrive as 
+// TOKEN_INTERPOLATION tokens that end in "${", and the last as a TOKEN_STRING.
+static void interpolation(bool can_assign) {
+  int count = 0;
+  do {
+    if (parser.prev.length > 3) {
+      emit_constant(OBJ_VAL(copy_string(parser.prev.start + 1, parser.prev.length - 3)));
+      count++;
+    }
+    expression();
+    count++;
+  } while (match(TOKEN_INTERPOLATION));
+  consume(TOKEN_STRING, "Expect end of string interpolation.");
+  if (parser.prev.length > 2) {
+    emit_constant(OBJ_VAL(copy_string(parser.prev.start + 1, parser.prev.length - 2)));
+    count++;
+  }
+  if (count > UINT8_MAX) {
+    error("Too many parts in string interpolation.");
+  }
+  emit_bytes(OP_BUILD_STRING, static_cast<uint8_t>(count));
+}
+
 static void named_variable(Token name, bool can_assign) {
+  Value value = NIL_VAL;
+  bool has_value = false;
+  if (resolve_const(&name, &value, &has_value)) {
+    if (can_assign && is_assignment(parser.curr.type)) {
+      error("Can't assign to a constant.");
+      return;
+    }
+    if (has_value) {
+      emit_constant(value);
+      return;
+    }
+  }
+
   uint8_t get_op, set_op;
+  bool by_value = false;
   int arg = resolve_local(curr, &name);
+  if (arg != -1 && curr->locals[arg].holds_method) {
+    // method_local() only sets this up when every use is a call, so the 
+    // receiver goes in the callee slot and the method comes from the next 
+    // local.
+    emit_indexed(OP_GET_LOCAL, arg);
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after method local.");
+    uint8_t arg_count = argument_list();
+    emit_indexed(OP_CALL_METHOD, arg + 1);
+    emit_byte(arg_count);
+    return;
+  }
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
-  } else if ((arg = resolve_upvalue(curr, &name)) != -1) {
-    get_op = OP_GET_UPVALUE;
+  } else if ((arg = resolve_upvalue(curr, &name, &by_value)) != -1) {
+    get_op = by_value ? OP_GET_CAPTURE : OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
   } else {
     arg = identifier_constant(&name);
@@ -487,8 +911,8 @@ static void named_variable(Token name, bool can_assign) {
     set_op = OP_SET_GLOBAL;
   }
   
-  if (!can_assign) {
-    emit_bytes(get_op, static_cast<uint8_t>(arg));
+  if (!can_assign || (by_value && is_assignment(parser.curr.type))) {
+    emit_indexed(get_op, arg);
     return;
   }
   
@@ -496,66 +920,101 @@ static void named_variable(Token name, bool can_assign) {
     case TOKEN_EQUAL:
       advance();
       expression();
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_PLUS_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_TERM);
       emit_byte(OP_ADD);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_MINUS_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_TERM);
       emit_byte(OP_SUBTRACT);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_STAR_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_FACTOR);
       emit_byte(OP_MULTIPLY);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_SLASH_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_FACTOR);
       emit_byte(OP_DIVIDE);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_STAR_STAR_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_POW);
       emit_byte(OP_POW);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_SLASH_SLASH_EQUAL:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       parse_precedence(PREC_FACTOR);
       emit_byte(OP_INT_DIVIDE);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
+      break;
+    case TOKEN_AMPERSAND_EQUAL:
+      advance();
+      emit_indexed(get_op, arg);
+      parse_precedence(PREC_BIT_AND);
+      emit_byte(OP_BIT_AND);
+      emit_indexed(set_op, arg);
+      break;
+    case TOKEN_PIPE_EQUAL:
+      advance();
+      emit_indexed(get_op, arg);
+      parse_precedence(PREC_BIT_OR);
+      emit_byte(OP_BIT_OR);
+      emit_indexed(set_op, arg);
+      break;
+    case TOKEN_CARET_EQUAL:
+      advance();
+      emit_indexed(get_op, arg);
+      parse_precedence(PREC_BIT_XOR);
+      emit_byte(OP_BIT_XOR);
+      emit_indexed(set_op, arg);
+      break;
+    case TOKEN_LESS_LESS_EQUAL:
+      advance();
+      emit_indexed(get_op, arg);
+      parse_precedence(PREC_SHIFT);
+      emit_byte(OP_SHIFT_LEFT);
+      emit_indexed(set_op, arg);
+      break;
+    case TOKEN_GREATER_GREATER_EQUAL:
+      advance();
+      emit_indexed(get_op, arg);
+      parse_precedence(PREC_SHIFT);
+      emit_byte(OP_SHIFT_RIGHT);
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_PLUS_PLUS:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       emit_constant(NUMBER_VAL(1));
       emit_byte(OP_ADD);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     case TOKEN_MINUS_MINUS:
       advance();
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
       emit_constant(NUMBER_VAL(1));
       emit_byte(OP_SUBTRACT);
-      emit_bytes(set_op, static_cast<uint8_t>(arg));
+      emit_indexed(set_op, arg);
       break;
     default:
-      emit_bytes(get_op, static_cast<uint8_t>(arg));
+      emit_indexed(get_op, arg);
   }
 }
 
@@ -576,17 +1035,22 @@ static void super_(bool can_assign) {
   
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifier_constant(&parser.prev);
+  int name = identifier_constant(&parser.prev);
   
   named_variable(synthetic_token("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
-    named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_SUPER_INVOKE, name);
-    emit_byte(arg_count);
+    emit_invoke(name, true, arg_count);
   } else {
+    // (super.m)(x) is folded into OP_SUPER_INVOKE the same way a property
+    // read is, so the offset is taken before super is pushed.
+    int offset = curr_chunk()->count;
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_GET_SUPER, name);
+    emit_indexed(OP_GET_SUPER, name);
+    curr->property_offset = offset;
+    curr->property_end = curr_chunk()->count;
+    curr->property_name = name;
+    curr->property_super = true;
   }
 }
 
@@ -596,6 +1060,7 @@ static void this_(bool can_assign) {
     return;
   }
   variable(false);
+  curr->this_end = curr_chunk()->count;
 } 
 
 static void unary(bool can_assign) {
@@ -608,11 +1073,45 @@ static void unary(bool can_assign) {
     case TOKEN_MINUS: 
       emit_byte(OP_NEGATE); 
       break;
+    case TOKEN_TILDE: 
+      emit_byte(OP_BIT_NOT); 
+      break;
     default: 
       return; 
   }
 }
 
+static void emit_upvalues(Upvalue* upvalues, int count) {
+  for (int i = 0; i < count; i++) {
+    uint16_t index = upvalues[i].index;
+    uint8_t flags = upvalues[i].is_local ? 1 : 0;
+    if (index > UINT8_MAX) {
+      emit_bytes(flags | 2, (index >> 8) & 0xff);
+      emit_byte(index & 0xff);
+    } else {
+      emit_bytes(flags, static_cast<uint8_t>(index));
+    }
+  }
+}
+
+static void emit_closure(ObjFunction* function, Compiler* compiler) {
+  if (function->upvalue_count == 0 && function->capture_count == 0) {
+    // Nothing is captured, so every evaluation can share one closure.
+    vm.push(OBJ_VAL(function));
+    ObjClosure* closure = new (function) ObjClosure(function);
+    vm.push(OBJ_VAL(closure));
+    emit_constant(OBJ_VAL(closure));
+    vm.pop();
+    vm.pop();
+  } else {
+    emit_indexed(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    emit_upvalues(compiler->upvalues, function->upvalue_count);
+    emit_upvalues(compiler->captures, function->capture_count);
+  }
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalue_capacity);
+  FREE_ARRAY(Upvalue, compiler->captures, compiler->capture_capacity);
+}
+
 static void lambda(bool can_assign) {
   Compiler compiler;
   init_compiler(&compiler, TYPE_LAMBDA);
@@ -624,7 +1123,7 @@ static void lambda(bool can_assign) {
       if (curr->function->arity > 255) {
         error_at_current("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parse_variable("Expect parameter name.");
+      int constant = parse_variable("Expect parameter name.");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -632,19 +1131,15 @@ static void lambda(bool can_assign) {
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
   block();
   ObjFunction* function = end_compiler();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
-  for (int i = 0; i < function->upvalue_count; i++) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
-  }
+  emit_closure(function, &compiler);
 }
 
 ParseRule rules[] = {
   [TOKEN_LEFT_PAREN]    = {grouping,    call,     PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {nullptr,     nullptr,  PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {nullptr,     nullptr,  PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {map,         nullptr,  PREC_NONE}, 
   [TOKEN_RIGHT_BRACE]   = {nullptr,     nullptr,  PREC_NONE},
-  [TOKEN_LEFT_BRACKET]  = {nullptr,     index,    PREC_CALL},
+  [TOKEN_LEFT_BRACKET]  = {list,        index,    PREC_CALL},
   [TOKEN_RIGHT_BRACKET] = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_COMMA]         = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_DOT]           = {nullptr,     dot,      PREC_CALL},
@@ -655,6 +1150,12 @@ ParseRule rules[] = {
   [TOKEN_STAR]          = {nullptr,     binary,   PREC_FACTOR},
   [TOKEN_STAR_STAR]     = {nullptr,     binary,   PREC_POW},
   [TOKEN_SLASH_SLASH]   = {nullptr,     binary,   PREC_FACTOR},
+  [TOKEN_AMPERSAND]     = {nullptr,     binary,   PREC_BIT_AND},
+  [TOKEN_PIPE]          = {nullptr,     binary,   PREC_BIT_OR},
+  [TOKEN_CARET]         = {nullptr,     binary,   PREC_BIT_XOR},
+  [TOKEN_TILDE]         = {unary,       nullptr,  PREC_NONE},
+  [TOKEN_LESS_LESS]     = {nullptr,     binary,   PREC_SHIFT},
+  [TOKEN_GREATER_GREATER] = {nullptr,   binary,   PREC_SHIFT},
   [TOKEN_BANG]          = {unary,       nullptr,  PREC_NONE},
   [TOKEN_BANG_EQUAL]    = {nullptr,     binary,   PREC_EQUALITY},
   [TOKEN_EQUAL]         = {nullptr,     nullptr,  PREC_NONE},
@@ -665,21 +1166,27 @@ ParseRule rules[] = {
   [TOKEN_LESS_EQUAL]    = {nullptr,     binary,   PREC_COMPARISON},
   [TOKEN_IDENTIFIER]    = {variable,    nullptr,  PREC_NONE},
   [TOKEN_STRING]        = {string,      nullptr,  PREC_NONE},
+  [TOKEN_INTERPOLATION] = {interpolation, nullptr, PREC_NONE},
   [TOKEN_NUMBER]        = {number,      nullptr,  PREC_NONE},
   [TOKEN_AND]           = {nullptr,     and_,     PREC_AND},
+  [TOKEN_CASE]          = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_CLASS]         = {nullptr,     nullptr,  PREC_NONE},
+  [TOKEN_DEFAULT]       = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_ELSE]          = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_FALSE]         = {literal,     nullptr,  PREC_NONE},
   [TOKEN_FOR]           = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_FN]            = {lambda,      nullptr,  PREC_NONE},
   [TOKEN_IF]            = {nullptr,     nullptr,  PREC_NONE},
+  [TOKEN_IN]            = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_NIL]           = {literal,     nullptr,  PREC_NONE},
   [TOKEN_OR]            = {nullptr,     or_,      PREC_OR},
   [TOKEN_RETURN]        = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_SUPER]         = {super_,      nullptr,  PREC_NONE},
+  [TOKEN_SWITCH]        = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_THIS]          = {this_,       nullptr,  PREC_NONE},
   [TOKEN_TRUE]          = {literal,      nullptr, PREC_NONE},
   [TOKEN_LET]           = {nullptr,     nullptr,  PREC_NONE},
+  [TOKEN_CONST]         = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_WHILE]         = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_ERROR]         = {nullptr,     nullptr,  PREC_NONE},
   [TOKEN_EOF]           = {nullptr,     nullptr,  PREC_NONE},
@@ -723,7 +1230,7 @@ static void function(FunctionType type) {
       if (curr->function->arity > 255) {
         error_at_current("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parse_variable("Expect parameter name.");
+      int constant = parse_variable("Expect parameter name.");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -731,16 +1238,12 @@ static void function(FunctionType type) {
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
   block();
   ObjFunction* function = end_compiler();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
-  for (int i = 0; i < function->upvalue_count; i++) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
-  }
+  emit_closure(function, &compiler);
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifier_constant(&parser.prev);
+  int constant = identifier_constant(&parser.prev);
   FunctionType type = TYPE_METHOD;
   if (
     parser.prev.length == curr_class->name.length && 
@@ -749,26 +1252,75 @@ static void method() {
     type = TYPE_INITIALIZER;
   }
   function(type);
-  emit_bytes(OP_METHOD, constant);
+  emit_indexed(OP_METHOD, constant);
+}
+
+static void field_declaration() {
+  do {
+    consume(TOKEN_IDENTIFIER, "Expect field name.");
+    int name = identifier_constant(&parser.prev);
+    emit_indexed(OP_FIELD, name);
+    ObjClass* layout = curr_class->layout;
+    if (layout == nullptr) continue;
+
+    ObjString* string = AS_STRING(curr_chunk()->constants.values[name]);
+    Value unused;
+    if (layout->field_slots.get(string, &unused)) {
+      error("Already a field with this name.");
+    }
+    layout->field_slots.set(string, NUMBER_VAL(layout->field_count++));
+    write_barrier(layout, OBJ_VAL(string));
+  } while (match(TOKEN_COMMA));
+  consume(TOKEN_SEMICOLON, "Expect ';' after field declaration.");
+}
+
+// Slots of a subclass's own fields follow its superclass's, so they can 
+// only be assigned at compile time when the superclass is a global class 
+// declared earlier in this script that is never reassigned.
+static ObjClass* superclass_layout(Token* name) {
+  for (Compiler* compiler = curr; compiler != nullptr; compiler = compiler->enclosing) {
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+      if (identifiers_equal(name, &compiler->locals[i].name)) return nullptr;
+    }
+  }
+  Compiler* script = script_compiler();
+  Value layout;
+  Value unused;
+  vm.push(OBJ_VAL(copy_string(name->start, name->length)));
+  ObjString* string = AS_STRING(vm.peek(0));
+  bool found = script->class_layouts.get(string, &layout) && !script->assigned_names.get(string, &unused);
+  vm.pop();
+  return found ? AS_CLASS(layout) : nullptr;
 }
 
 static void class_declaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token class_name = parser.prev;
-  uint8_t name_constant = identifier_constant(&parser.prev);
+  int name_constant = identifier_constant(&parser.prev);
+  bool is_global = curr->scope_depth == 0 && curr->enclosing == nullptr;
  
-  declare_variable();
-  emit_bytes(OP_CLASS, name_constant);
+  declare_name();
+  emit_indexed(OP_CLASS, name_constant);
   define_variable(name_constant);
   
   ClassCompiler class_compiler;
   class_compiler.name = class_name;
   class_compiler.has_superclass = false;
   class_compiler.enclosing = curr_class;
+  class_compiler.layout = nullptr;
   curr_class = &class_compiler;
+  class_compiler.layout = new ObjClass(AS_STRING(curr_chunk()->constants.values[name_constant]));
   
   if (match(TOKEN_COLON)) {
     consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    ObjClass* superclass = superclass_layout(&parser.prev);
+    if (superclass != nullptr) {
+      table_add_all(&superclass->field_slots, &class_compiler.layout->field_slots);
+      write_barrier_all(class_compiler.layout);
+      class_compiler.layout->field_count = superclass->field_count;
+    } else {
+      class_compiler.layout = nullptr;
+    }
     variable(false);
     if (identifiers_equal(&class_name, &parser.prev)) {
       error("A class can't inherit from itself.");
@@ -784,26 +1336,91 @@ static void class_declaration() {
   named_variable(class_name, false);
   consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+    if (match(TOKEN_LET)) {
+      field_declaration();
+    } else {
+      method();
+    }
   }
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
   emit_byte(OP_POP);
+  if (is_global && class_compiler.layout != nullptr) {
+    script_compiler()->class_layouts.set(class_compiler.layout->name, OBJ_VAL(class_compiler.layout));
+  }
   
   if (class_compiler.has_superclass) end_scope();
   curr_class = curr_class->enclosing;
 }
 
 static void fn_declaration() {
-  uint8_t global = parse_variable("Expect function name.");
+  int global = parse_variable("Expect function name.");
   mark_initialized();
   function(TYPE_FUNCTION);
   define_variable(global);
 }
 
-static void var_declaration() {
-  uint8_t global = parse_variable("Expect variable name.");
+// Scans the rest of the block a local was just declared in, and returns 
+// true if every use of its name is a direct call that isn't inside a nested 
+// function or class, where the local would be captured.
+static bool only_called(Token* name) {
+  Scanner state = save_scanner();
+  int depth = 0;
+  int closure_depth = -1;
+  bool closure_next = false;
+  bool result = true;
+  TokenType before = parser.curr.type;
+  Token token = scan_token();
+  while (token.type != TOKEN_EOF) {
+    Token next = scan_token();
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+      if (closure_next && closure_depth == -1) closure_depth = depth;
+      closure_next = false;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      if (depth == closure_depth) closure_depth = -1;
+      if (--depth < 0) break;
+    } else if (token.type == TOKEN_FN || token.type == TOKEN_CLASS) {
+      closure_next = true;
+    } else if (token.type == TOKEN_IDENTIFIER && before != TOKEN_DOT && identifiers_equal(&token, name)) {
+      if (closure_depth != -1 || closure_next || before == TOKEN_FN || next.type != TOKEN_LEFT_PAREN) {
+        result = false;
+        break;
+      }
+    }
+    before = token.type;
+    token = next;
+  }
+  restore_scanner(state);
+  return result;
+}
+
+// let f = obj.m; keeps obj in f and the method closure in a hidden local 
+// after it instead of allocating a bound method, when f is never assigned 
+// and is only ever called outside any nested function. The method is still 
+// looked up once, here, and each f(x) calls it with obj as the receiver. If 
+// m turns out to be a field, f holds its value and the hidden local is nil.
+static void method_local() {
+  if (curr->scope_depth == 0 || !check(TOKEN_SEMICOLON) || !property_pending()) return;
+  int slot = curr->local_count - 1;
+  if (curr->locals[slot].is_assigned || !only_called(&curr->locals[slot].name)) return;
+  curr_chunk()->count = curr->property_offset;
+  curr->property_offset = -1;
+  if (curr->property_super) {
+    named_variable(synthetic_token("super"), false);
+    emit_indexed(OP_GET_SUPER_METHOD, curr->property_name);
+  } else {
+    emit_indexed(OP_GET_METHOD, curr->property_name);
+  }
+  add_local(synthetic_token(""));
+  curr->locals[slot].depth = curr->scope_depth;
+  curr->locals[slot].holds_method = true;
+}
+
+static void var_definition() {
+  int global = declare_name();
   if (match(TOKEN_EQUAL)) {
     expression();
+    method_local();
   } else {
     emit_byte(OP_NIL);
   }
@@ -811,19 +1428,214 @@ static void var_declaration() {
   define_variable(global);
 }
 
+static void var_declaration() {
+  consume(TOKEN_IDENTIFIER, "Expect variable name.");
+  var_definition();
+}
+
+// The initializer counts as a compile-time constant when it compiled to a 
+// single literal load, possibly negated.
+static bool constant_initializer(int start, Value* value) {
+  Chunk* chunk = curr_chunk();
+  int length = chunk->count - start;
+  if (length <= 0) return false;
+  uint8_t* code = &chunk->code[start];
+  bool negate = length > 1 && code[length - 1] == OP_NEGATE;
+  if (negate) length--;
+
+  switch (code[0]) {
+    case OP_NIL: *value = NIL_VAL; break;
+    case OP_TRUE: *value = TRUE_VAL; break;
+    case OP_FALSE: *value = FALSE_VAL; break;
+    case OP_CONSTANT: 
+      if (length != 2) return false;
+      *value = chunk->constants.values[code[1]]; 
+      break;
+    case OP_CONSTANT_LONG:
+      if (length != 4) return false;
+      *value = chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]];
+      break;
+    default: return false;
+  }
+  if (length != 1 && code[0] != OP_CONSTANT && code[0] != OP_CONSTANT_LONG) return false;
+  if (!negate) return true;
+  if (!IS_NUMBER(*value)) return false;
+
+  *value = NUMBER_VAL(-AS_NUMBER(*value));
+  chunk->count = start;
+  emit_constant(*value);
+  return true;
+}
+
+static void const_declaration() {
+  int global = parse_variable("Expect constant name.");
+  consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+  int start = curr_chunk()->count;
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+  Value value = NIL_VAL;
+  bool has_value = constant_initializer(start, &value);
+  if (curr->scope_depth > 0) {
+    Local* local = &curr->locals[curr->local_count - 1];
+    local->is_const = true;
+    local->has_value = has_value;
+    local->value = value;
+  } else {
+    Compiler* script = script_compiler();
+    ObjString* name = AS_STRING(curr_chunk()->constants.values[global]);
+    script->const_globals.set(name, NIL_VAL);
+    if (has_value) script->const_values.set(name, value);
+  }
+  define_variable(global);
+}
+
 static void expression_statement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
   emit_byte(OP_POP);
 }
 
+// for (let i in range(a, b, step)) keeps the counter, the end and the step 
+// in three consecutive locals. OP_FOR_PREP fills in the missing arguments 
+// and skips an empty range, and OP_FOR_RANGE steps, tests and jumps back.
+// The exit offset is reserved at 24 bits like any forward jump.
+// range(...) is only compiled as a counted loop when it is the whole 
+// iterable, so something like range(0, n).map(f) still calls the native.
+// The loop stands in for the native, so the name also has to mean the 
+// native: no local here or in an enclosing function may shadow it, the 
+// script may not declare or assign a global of that name, and an earlier 
+// script must not have replaced it.
+static bool is_range_native(Token* name) {
+  for (Compiler* compiler = curr; compiler != nullptr; compiler = compiler->enclosing) {
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+      if (identifiers_equal(name, &compiler->locals[i].name)) return false;
+    }
+  }
+  Compiler* script = script_compiler();
+  Value value;
+  vm.push(OBJ_VAL(copy_string(name->start, name->length)));
+  ObjString* string = AS_STRING(vm.peek(0));
+  bool is_native = 
+    !script->global_names.get(string, &value) && !script->assigned_names.get(string, &value) &&
+    vm.globals.get(string, &value) && IS_NATIVE(value) && AS_NATIVE(value) == range_native;
+  vm.pop();
+  return is_native;
+}
+
+static bool check_range() {
+  if (!check(TOKEN_IDENTIFIER) || parser.curr.length != 5 || memcmp(parser.curr.start, "range", 5) != 0) {
+    return false;
+  }
+  if (!is_range_native(&parser.curr)) return false;
+  Scanner state = save_scanner();
+  bool is_range = scan_token().type == TOKEN_LEFT_PAREN;
+  int depth = 1;
+  while (is_range && depth > 0) {
+    TokenType type = scan_token().type;
+    if (type == TOKEN_LEFT_PAREN) depth++;
+    else if (type == TOKEN_RIGHT_PAREN) depth--;
+    else if (type == TOKEN_EOF) is_range = false;
+  }
+  is_range = is_range && scan_token().type == TOKEN_RIGHT_PAREN;
+  restore_scanner(state);
+  return is_range;
+}
+
+static void range_loop(Token name) {
+  advance();
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'range'.");
+  int arg_count = 0;
+  do {
+    expression();
+    arg_count++;
+  } while (match(TOKEN_COMMA));
+  if (arg_count > 3) {
+    error("Expect at most 3 arguments to 'range'.");
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after range arguments.");
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  emit_bytes(OP_FOR_PREP, static_cast<uint8_t>(arg_count));
+  emit_byte(0xff);
+  emit_bytes(0xff, 0xff);
+  int exit_jump = curr_chunk()->count - 3;
+
+  int slot = curr->local_count;
+  add_local(name);
+  add_local(synthetic_token(""));
+  add_local(synthetic_token(""));
+  for (int i = slot; i < curr->local_count; i++) {
+    curr->locals[i].depth = curr->scope_depth;
+  }
+  // The VM steps the counter in place, so closures must share it.
+  curr->locals[slot].is_assigned = true;
+
+  int loop_start = curr_chunk()->count;
+  statement();
+  emit_loop_instruction(OP_FOR_RANGE, OP_FOR_RANGE_LONG, slot, -1, loop_start);
+
+  int jump = curr_chunk()->count - exit_jump - 3;
+  if (jump > 0xffffff) error("Loop body too large.");
+  curr_chunk()->code[exit_jump] = (jump >> 16) & 0xff;
+  curr_chunk()->code[exit_jump + 1] = (jump >> 8) & 0xff;
+  curr_chunk()->code[exit_jump + 2] = jump & 0xff;
+}
+
+// The iterable and a cursor sit in hidden locals below the loop variables.
+// OP_ITER_NEXT fills the variables straight from list and map storage; 
+// OP_ITER_VALUE takes the result when next() had to be called instead.
+static void iterator_loop(Token* names, int var_count) {
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  int slot = curr->local_count;
+  add_local(synthetic_token(""));
+  add_local(synthetic_token(""));
+  emit_bytes(OP_ITER_INIT, static_cast<uint8_t>(var_count));
+  for (int i = 0; i < var_count; i++) {
+    add_local(names[i]);
+    curr->locals[curr->local_count - 1].is_assigned = true;
+    emit_byte(OP_NIL);
+  }
+  for (int i = slot; i < curr->local_count; i++) {
+    curr->locals[i].depth = curr->scope_depth;
+  }
+
+  int next_jump = emit_jump(OP_JUMP);
+  int loop_start = curr_chunk()->count;
+  statement();
+  patch_jump(next_jump);
+  emit_loop_instruction(OP_ITER_NEXT, OP_ITER_NEXT_LONG, slot, var_count, loop_start);
+  emit_loop_instruction(OP_ITER_VALUE, OP_ITER_VALUE_LONG, slot, -1, loop_start);
+}
+
 static void for_statement() {
   begin_scope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   if (match(TOKEN_SEMICOLON)) {
     // nothing
   } else if (match(TOKEN_LET)) {
-    var_declaration();
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token names[2] = {parser.prev, parser.prev};
+    if (match(TOKEN_COMMA)) {
+      consume(TOKEN_IDENTIFIER, "Expect variable name.");
+      names[1] = parser.prev;
+      consume(TOKEN_IN, "Expect 'in' after loop variables.");
+      iterator_loop(names, 2);
+      end_scope();
+      return;
+    }
+    if (match(TOKEN_IN)) {
+      if (check_range()) {
+        range_loop(names[0]);
+      } else {
+        iterator_loop(names, 1);
+      }
+      end_scope();
+      return;
+    }
+    var_definition();
   } else {
     expression_statement();
   }
@@ -885,6 +1697,243 @@ static void return_statement() {
   }
 }
 
+enum SwitchKind {
+  SWITCH_TABLE,
+  SWITCH_MAP,
+  SWITCH_CHAIN
+};
+
+// A case label is constant when it is a single literal, a negated number or 
+// a constant with a known value. Other labels are compared at runtime.
+static bool label_value(Token* tokens, int count, Value* value) {
+  if (count == 2 && tokens[0].type == TOKEN_MINUS && tokens[1].type == TOKEN_NUMBER) {
+    *value = NUMBER_VAL(-strtod(tokens[1].start, nullptr));
+    return true;
+  }
+  if (count != 1) return false;
+  bool has_value = false;
+  switch (tokens[0].type) {
+    case TOKEN_NUMBER:
+      *value = NUMBER_VAL(strtod(tokens[0].start, nullptr));
+      return true;
+    case TOKEN_STRING:
+      *value = OBJ_VAL(copy_string(tokens[0].start + 1, tokens[0].length - 2));
+      return true;
+    case TOKEN_TRUE:
+    case TOKEN_FALSE:
+      *value = BOOL_VAL(tokens[0].type == TOKEN_TRUE);
+      return true;
+    case TOKEN_IDENTIFIER:
+      return resolve_const(&tokens[0], value, &has_value) && has_value && !IS_NIL(*value);
+    default:
+      return false;
+  }
+}
+
+static bool case_label(Value* value) {
+  Token tokens[2];
+  int count = 0;
+  while (!check(TOKEN_COMMA) && !check(TOKEN_COLON) && !check(TOKEN_EOF)) {
+    advance();
+    if (count < 2) tokens[count] = parser.prev;
+    count++;
+  }
+  return label_value(tokens, count, value);
+}
+
+// Scans the labels of the switch body ahead of compiling it. Dense int 
+// labels get a jump table, other constant labels a hashed lookup, and a 
+// switch with any runtime label compares the labels in order.
+static SwitchKind scan_switch(int32_t* low, int* span) {
+  Scanner state = save_scanner();
+  SwitchKind kind = SWITCH_MAP;
+  bool all_int = true;
+  int count = 0;
+  int64_t min = INT32_MAX;
+  int64_t max = INT32_MIN;
+  int depth = 0;
+  Token token = parser.curr;
+  while (token.type != TOKEN_EOF && kind != SWITCH_CHAIN) {
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      if (depth-- == 0) break;
+    } else if (token.type == TOKEN_CASE && depth == 0) {
+      do {
+        Token tokens[2];
+        int length = 0;
+        token = scan_token();
+        while (token.type != TOKEN_COMMA && token.type != TOKEN_COLON && token.type != TOKEN_EOF) {
+          if (length < 2) tokens[length] = token;
+          length++;
+          token = scan_token();
+        }
+        Value value;
+        if (!label_value(tokens, length, &value)) {
+          kind = SWITCH_CHAIN;
+          break;
+        }
+        if (IS_INT(value)) {
+          if (AS_INT(value) < min) min = AS_INT(value);
+          if (AS_INT(value) > max) max = AS_INT(value);
+        } else {
+          all_int = false;
+        }
+        count++;
+      } while (token.type == TOKEN_COMMA);
+    }
+    token = scan_token();
+  }
+  restore_scanner(state);
+
+  if (count == 0) return SWITCH_CHAIN;
+  if (kind == SWITCH_MAP && all_int && max - min < 2 * count + 8) {
+    *low = static_cast<int32_t>(min);
+    *span = static_cast<int>(max - min + 1);
+    return SWITCH_TABLE;
+  }
+  return kind;
+}
+
+static void case_body() {
+  begin_scope();
+  while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    declaration();
+  }
+  end_scope();
+}
+
+// Case and default offsets are 24 bits, like the other operands a body of 
+// any size has to fit in. An entry that is still all ones hasn't been set.
+static void patch_case(int dispatch, int entry) {
+  int offset = curr_chunk()->count - dispatch;
+  if (offset >= 0xffffff) error("Too much code to jump over.");
+  uint8_t* code = curr_chunk()->code;
+  if (code[entry] != 0xff || code[entry + 1] != 0xff || code[entry + 2] != 0xff) {
+    error("Duplicate case label.");
+  }
+  code[entry] = (offset >> 16) & 0xff;
+  code[entry + 1] = (offset >> 8) & 0xff;
+  code[entry + 2] = offset & 0xff;
+}
+
+// Constant labels jump straight to their body from one OP_SWITCH_TABLE or 
+// OP_SWITCH_MAP, whose offsets are filled in as the bodies are compiled.
+// Cases don't fall through, and a default has to come last.
+static void switch_statement() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after switch value.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before switch body.");
+
+  int32_t low = 0;
+  int span = 0;
+  SwitchKind kind = scan_switch(&low, &span);
+  int default_entry = 0;
+  ObjNativeMap* targets = nullptr;
+  begin_scope();
+  if (kind == SWITCH_TABLE) {
+    if (span > 0xffffff) error("Too many case labels in one switch.");
+    emit_byte(OP_SWITCH_TABLE);
+    emit_bytes((low >> 24) & 0xff, (low >> 16) & 0xff);
+    emit_bytes((low >> 8) & 0xff, low & 0xff);
+    emit_byte((span >> 16) & 0xff);
+    emit_bytes((span >> 8) & 0xff, span & 0xff);
+    default_entry = curr_chunk()->count;
+    for (int i = 0; i <= span; i++) {
+      emit_byte(0xff);
+      emit_bytes(0xff, 0xff);
+    }
+  } else if (kind == SWITCH_MAP) {
+    targets = new ObjNativeMap();
+    emit_indexed(OP_SWITCH_MAP, make_constant(OBJ_VAL(targets)));
+    default_entry = curr_chunk()->count;
+    emit_byte(0xff);
+    emit_bytes(0xff, 0xff);
+  } else {
+    add_local(synthetic_token(""));
+    mark_initialized();
+  }
+  int subject = curr->local_count - 1;
+  int dispatch = curr_chunk()->count;
+
+  ValueArray end_jumps;
+  bool has_default = false;
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    if (has_default) error_at_current("Expect 'default' to be the last case.");
+    if (match(TOKEN_DEFAULT)) {
+      consume(TOKEN_COLON, "Expect ':' after 'default'.");
+      has_default = true;
+      if (kind != SWITCH_CHAIN) patch_case(dispatch, default_entry);
+      case_body();
+      continue;
+    }
+    consume(TOKEN_CASE, "Expect 'case' or 'default'.");
+
+    int next_case = -1;
+    if (kind == SWITCH_CHAIN) {
+      ValueArray body_jumps;
+      for (;;) {
+        emit_indexed(OP_GET_LOCAL, subject);
+        expression();
+        emit_byte(OP_EQUAL);
+        if (!check(TOKEN_COMMA)) break;
+        int skip = emit_jump(OP_JUMP_IF_FALSE);
+        emit_byte(OP_POP);
+        body_jumps.write(INT_VAL(emit_jump(OP_JUMP)));
+        patch_jump(skip);
+        emit_byte(OP_POP);
+        advance();
+      }
+      next_case = emit_jump(OP_JUMP_IF_FALSE);
+      emit_byte(OP_POP);
+      for (int i = 0; i < body_jumps.count; i++) patch_jump(AS_INT(body_jumps.values[i]));
+      body_jumps.clear();
+    } else {
+      do {
+        Value value;
+        if (!case_label(&value)) {
+          error("Expect a constant case label.");
+        } else if (kind == SWITCH_TABLE) {
+          patch_case(dispatch, default_entry + 3 + 3 * (AS_INT(value) - low));
+        } else {
+          vm.push(value);
+          if (!targets->map.set(value, INT_VAL(curr_chunk()->count - dispatch))) {
+            error("Duplicate case label.");
+          }
+          write_barrier(targets, value);
+          vm.pop();
+        }
+      } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_COLON, "Expect ':' after case label.");
+
+    case_body();
+    if (next_case != -1 || !check(TOKEN_RIGHT_BRACE)) {
+      end_jumps.write(INT_VAL(emit_jump(OP_JUMP)));
+    }
+    if (next_case != -1) {
+      patch_jump(next_case);
+      emit_byte(OP_POP);
+    }
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch body.");
+
+  if (kind != SWITCH_CHAIN && !has_default) patch_case(dispatch, default_entry);
+  if (kind == SWITCH_TABLE) {
+    // Gaps in the table go wherever the default does.
+    uint8_t* code = curr_chunk()->code;
+    for (int entry = default_entry + 3; entry < dispatch; entry += 3) {
+      if (code[entry] == 0xff && code[entry + 1] == 0xff && code[entry + 2] == 0xff) {
+        memcpy(&code[entry], &code[default_entry], 3);
+      }
+    }
+  }
+  for (int i = 0; i < end_jumps.count; i++) patch_jump(AS_INT(end_jumps.values[i]));
+  end_jumps.clear();
+  end_scope();
+}
+
 static void while_statement() {
   int loop_start = curr_chunk()->count;
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
@@ -906,8 +1955,10 @@ static void synchronize() {
       case TOKEN_CLASS:
       case TOKEN_FN:
       case TOKEN_LET:
+      case TOKEN_CONST:
       case TOKEN_FOR:
       case TOKEN_IF:
+      case TOKEN_SWITCH:
       case TOKEN_WHILE:
       case TOKEN_RETURN:
         return;
@@ -925,6 +1976,8 @@ static void declaration() {
     fn_declaration();
   } else if (match(TOKEN_LET)) {
     var_declaration();
+  } else if (match(TOKEN_CONST)) {
+    const_declaration();
   } else {
     statement();
   }
@@ -938,6 +1991,8 @@ static void statement() {
     if_statement();
   } else if (match(TOKEN_RETURN)) {
     return_statement();
+  } else if (match(TOKEN_SWITCH)) {
+    switch_statement();
   } else if (match(TOKEN_WHILE)) {
     while_statement();
   } else if (match(TOKEN_LEFT_BRACE)) {
@@ -967,7 +2022,15 @@ void mark_compiler_roots() {
   Compiler* compiler = curr;
   while (compiler != nullptr) {
     mark_object(static_cast<Obj*>(compiler->function));
+    compiler->assigned_names.mark();
+    compiler->const_globals.mark();
+    compiler->const_values.mark();
+    compiler->class_layouts.mark();
+    compiler->global_names.mark();
     compiler = compiler->enclosing;
   }
+  for (ClassCompiler* klass = curr_class; klass != nullptr; klass = klass->enclosing) {
+    mark_object(static_cast<Obj*>(klass->layout));
+  }
 }
 
@@ -10,21 +10,41 @@ void disassemble_chunk(Chunk* chunk, const char* name) {
   }
 }
 
-static int constant_instruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+static int read_index(Chunk* chunk, int offset, bool wide) {
+  if (!wide) return chunk->code[offset];
+  return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+static int constant_instruction(const char* name, Chunk* chunk, int offset, bool wide) {
+  int constant = read_index(chunk, offset + 1, wide);
   printf("%-16s %4d '", name, constant);
   print_value(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 2;
+  return offset + (wide ? 4 : 2);
 }
 
-static int invoke_instruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t arg_count = chunk->code[offset + 2];
+static int constant_long_instruction(const char* name, Chunk* chunk, int offset) {
+  int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int invoke_instruction(const char* name, Chunk* chunk, int offset, bool wide) {
+  int constant = read_index(chunk, offset + 1, wide);
+  uint8_t arg_count = chunk->code[offset + (wide ? 4 : 2)];
   printf("%-16s (%d args) %4d '", name, arg_count, constant);
   print_value(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 3;
+  return offset + (wide ? 5 : 3);
+}
+
+static int call_method_instruction(const char* name, Chunk* chunk, int offset, bool wide) {
+  int slot = read_index(chunk, offset + 1, wide);
+  uint8_t arg_count = chunk->code[offset + (wide ? 4 : 2)];
+  printf("%-16s (%d args) %4d\n", name, arg_count, slot);
+  return offset + (wide ? 5 : 3);
 }
 
 static int simple_instruction(const char* name, int offset) {
@@ -32,10 +52,10 @@ static int simple_instruction(const char* name, int offset) {
   return offset + 1;
 }
 
-static int byte_instruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t slot = chunk->code[offset + 1];
+static int byte_instruction(const char* name, Chunk* chunk, int offset, bool wide) {
+  int slot = read_index(chunk, offset + 1, wide);
   printf("%-16s %4d\n", name, slot);
-  return offset + 2; 
+  return offset + (wide ? 4 : 2); 
 }
 
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset) {
@@ -45,7 +65,92 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset
   return offset + 3;
 }
 
-int disassemble_instruction(Chunk* chunk, int offset) {
+static int jump_table_instruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t index = static_cast<uint16_t>(chunk->code[offset + 1] << 8);
+  index |= chunk->code[offset + 2];
+  printf("%-16s %4d -> %d\n", name, offset, AS_INT(chunk->jump_targets.values[index]));
+  return offset + 3;
+}
+
+static int jump_long_instruction(const char* name, int sign, Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+  return offset + 4;
+}
+
+static int prep_instruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t arg_count = chunk->code[offset + 1];
+  int jump = (chunk->code[offset + 2] << 16) | (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d -> %d\n", name, arg_count, offset, offset + 5 + jump);
+  return offset + 5;
+}
+
+static int for_instruction(const char* name, Chunk* chunk, int offset, bool wide, bool long_offset) {
+  int slot = read_index(chunk, offset + 1, wide);
+  int next = offset + (wide ? 4 : 2) + (long_offset ? 3 : 2);
+  int jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+  if (long_offset) jump |= chunk->code[next - 3] << 16;
+  printf("%-16s %4d %4d -> %d\n", name, slot, offset, next - jump);
+  return next;
+}
+
+static int iter_instruction(const char* name, Chunk* chunk, int offset, bool wide, bool long_offset) {
+  int slot = read_index(chunk, offset + 1, wide);
+  int next = offset + (wide ? 5 : 3) + (long_offset ? 3 : 2);
+  uint8_t var_count = chunk->code[offset + (wide ? 5 : 2)];
+  int jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+  if (long_offset) jump |= chunk->code[next - 3] << 16;
+  printf("%-16s (%d vars) %4d %4d -> %d\n", name, var_count, slot, offset, next - jump);
+  return next;
+}
+
+static int switch_table_instruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t* table = &chunk->code[offset + 1];
+  int32_t low = static_cast<int32_t>(
+    (static_cast<uint32_t>(table[0]) << 24) | (table[1] << 16) | (table[2] << 8) | table[3]
+  );
+  int span = (table[4] << 16) | (table[5] << 8) | table[6];
+  int next = offset + 11 + 3 * span;
+  printf("%-16s %4d\n", name, offset);
+  printf("%04d    |   default -> %d\n", offset, next + ((table[7] << 16) | (table[8] << 8) | table[9]));
+  for (int i = 0; i < span; i++) {
+    uint8_t* entry = &table[10 + 3 * i];
+    int jump = (entry[0] << 16) | (entry[1] << 8) | entry[2];
+    printf("%04d    | %9d -> %d\n", offset, low + i, next + jump);
+  }
+  return next;
+}
+
+static int switch_map_instruction(const char* name, Chunk* chunk, int offset, bool wide) {
+  int constant = read_index(chunk, offset + 1, wide);
+  int next = offset + (wide ? 7 : 5);
+  int jump = (chunk->code[next - 3] << 16) | (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+  printf("%-16s %4d %4d -> %d\n", name, constant, offset, next + jump);
+  return next;
+}
+
+static int closure_instruction(Chunk* chunk, int offset, bool wide) {
+  int constant = read_index(chunk, offset + 1, wide);
+  offset += wide ? 4 : 2;
+  printf("%-16s %4d ", "OP_CLOSURE", constant);
+  print_value(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+  int count = function->upvalue_count + function->capture_count;
+  for (int j = 0; j < count; j++) {
+    int descriptor = offset;
+    int flags = chunk->code[offset++];
+    int index = (flags & 2) ? (chunk->code[offset] << 8) | chunk->code[offset + 1] : chunk->code[offset];
+    offset += (flags & 2) ? 2 : 1;
+    const char* kind;
+    if (j < function->upvalue_count) kind = (flags & 1) ? "local" : "upvalue";
+    else kind = (flags & 1) ? "local value" : "captured value";
+    printf("%04d      |                     %s %d\n", descriptor, kind, index);
+  }
+  return offset;
+}
+
+static int disassemble(Chunk* chunk, int offset, bool wide) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
     printf("   | ");
@@ -55,7 +160,9 @@ int disassemble_instruction(Chunk* chunk, int offset) {
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
     case OP_CONSTANT:
-      return constant_instruction("OP_CONSTANT", chunk, offset);
+      return constant_instruction("OP_CONSTANT", chunk, offset, wide);
+    case OP_CONSTANT_LONG:
+      return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
       return simple_instruction("OP_NIL", offset);
     case OP_TRUE:
@@ -65,25 +172,35 @@ int disassemble_instruction(Chunk* chunk, int offset) {
     case OP_POP:
       return simple_instruction("OP_POP", offset);
     case OP_GET_LOCAL:
-      return byte_instruction("OP_GET_LOCAL", chunk, offset);
+      return byte_instruction("OP_GET_LOCAL", chunk, offset, wide);
     case OP_SET_LOCAL:
-      return byte_instruction("OP_SET_LOCAL", chunk, offset);
+      return byte_instruction("OP_SET_LOCAL", chunk, offset, wide);
     case OP_GET_GLOBAL:
-      return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+      return constant_instruction("OP_GET_GLOBAL", chunk, offset, wide);
     case OP_DEFINE_GLOBAL:
-      return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset, wide);
     case OP_SET_GLOBAL:
-      return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+      return constant_instruction("OP_SET_GLOBAL", chunk, offset, wide);
     case OP_GET_UPVALUE:
-      return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+      return byte_instruction("OP_GET_UPVALUE", chunk, offset, wide);
     case OP_SET_UPVALUE:
-      return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+      return byte_instruction("OP_SET_UPVALUE", chunk, offset, wide);
+    case OP_GET_CAPTURE:
+      return byte_instruction("OP_GET_CAPTURE", chunk, offset, wide);
     case OP_GET_PROPERTY:
-      return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+      return constant_instruction("OP_GET_PROPERTY", chunk, offset, wide);
     case OP_SET_PROPERTY:
-      return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+      return constant_instruction("OP_SET_PROPERTY", chunk, offset, wide);
+    case OP_GET_FIELD:
+      return byte_instruction("OP_GET_FIELD", chunk, offset, wide);
+    case OP_SET_FIELD:
+      return byte_instruction("OP_SET_FIELD", chunk, offset, wide);
     case OP_GET_SUPER:
-      return constant_instruction("OP_GET_SUPER", chunk, offset);
+      return constant_instruction("OP_GET_SUPER", chunk, offset, wide);
+    case OP_GET_METHOD:
+      return constant_instruction("OP_GET_METHOD", chunk, offset, wide);
+    case OP_GET_SUPER_METHOD:
+      return constant_instruction("OP_GET_SUPER_METHOD", chunk, offset, wide);
     case OP_EQUAL:
       return simple_instruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -98,51 +215,98 @@ int disassemble_instruction(Chunk* chunk, int offset) {
       return simple_instruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
       return simple_instruction("OP_DIVIDE", offset);
+    case OP_BIT_AND:
+      return simple_instruction("OP_BIT_AND", offset);
+    case OP_BIT_OR:
+      return simple_instruction("OP_BIT_OR", offset);
+    case OP_BIT_XOR:
+      return simple_instruction("OP_BIT_XOR", offset);
+    case OP_SHIFT_LEFT:
+      return simple_instruction("OP_SHIFT_LEFT", offset);
+    case OP_SHIFT_RIGHT:
+      return simple_instruction("OP_SHIFT_RIGHT", offset);
     case OP_NOT:
       return simple_instruction("OP_NOT", offset);
     case OP_NEGATE:
       return simple_instruction("OP_NEGATE", offset);
+    case OP_BIT_NOT:
+      return simple_instruction("OP_BIT_NOT", offset);
     case OP_PRINT:
       return simple_instruction("OP_PRINT", offset);
     case OP_JUMP:
       return jump_instruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_LONG:
+      return jump_table_instruction("OP_JUMP_LONG", chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return jump_table_instruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+    case OP_SWITCH_TABLE:
+      return switch_table_instruction("OP_SWITCH_TABLE", chunk, offset);
+    case OP_SWITCH_MAP:
+      return switch_map_instruction("OP_SWITCH_MAP", chunk, offset, wide);
     case OP_LOOP:
       return jump_instruction("OP_LOOP", -1, chunk, offset);
+    case OP_FOR_PREP:
+      return prep_instruction("OP_FOR_PREP", chunk, offset);
+    case OP_FOR_RANGE:
+      return for_instruction("OP_FOR_RANGE", chunk, offset, wide, false);
+    case OP_FOR_RANGE_LONG:
+      return for_instruction("OP_FOR_RANGE_LONG", chunk, offset, wide, true);
+    case OP_ITER_INIT:
+      return byte_instruction("OP_ITER_INIT", chunk, offset, false);
+    case OP_ITER_NEXT:
+      return iter_instruction("OP_ITER_NEXT", chunk, offset, wide, false);
+    case OP_ITER_NEXT_LONG:
+      return iter_instruction("OP_ITER_NEXT_LONG", chunk, offset, wide, true);
+    case OP_ITER_VALUE:
+      return for_instruction("OP_ITER_VALUE", chunk, offset, wide, false);
+    case OP_ITER_VALUE_LONG:
+      return for_instruction("OP_ITER_VALUE_LONG", chunk, offset, wide, true);
+    case OP_LOOP_LONG:
+      return jump_long_instruction("OP_LOOP_LONG", -1, chunk, offset);
     case OP_CALL:
-      return byte_instruction("OP_CALL", chunk, offset);
+      return byte_instruction("OP_CALL", chunk, offset, false);
     case OP_INVOKE:
-      return invoke_instruction("OP_INVOKE", chunk, offset);
+      return invoke_instruction("OP_INVOKE", chunk, offset, wide);
     case OP_SUPER_INVOKE:
-      return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
-      print_value(chunk->constants.values[constant]);
-      printf("\n");
-      ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-      for (int j = 0; j < function->upvalue_count; j++) {
-        int is_local = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
-      }
-      return offset;
-    }
+      return invoke_instruction("OP_SUPER_INVOKE", chunk, offset, wide);
+    case OP_CALL_METHOD:
+      return call_method_instruction("OP_CALL_METHOD", chunk, offset, wide);
+    case OP_CLOSURE:
+      return closure_instruction(chunk, offset, wide);
     case OP_CLOSE_UPVALUE:
       return simple_instruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
       return simple_instruction("OP_RETURN", offset);
     case OP_CLASS:
-      return constant_instruction("OP_CLASS", chunk, offset);
+      return constant_instruction("OP_CLASS", chunk, offset, wide);
     case OP_INHERIT:
       return simple_instruction("OP_INHERIT", offset);
     case OP_METHOD:
-      return constant_instruction("OP_METHOD", chunk, offset);
+      return constant_instruction("OP_METHOD", chunk, offset, wide);
+    case OP_FIELD:
+      return constant_instruction("OP_FIELD", chunk, offset, wide);
+    case OP_BUILD_LIST:
+      return byte_instruction("OP_BUILD_LIST", chunk, offset, wide);
+    case OP_EXTEND_LIST:
+      return byte_instruction("OP_EXTEND_LIST", chunk, offset, wide);
+    case OP_BUILD_MAP:
+      return byte_instruction("OP_BUILD_MAP", chunk, offset, wide);
+    case OP_EXTEND_MAP:
+      return byte_instruction("OP_EXTEND_MAP", chunk, offset, wide);
+    case OP_BUILD_STRING:
+      return byte_instruction("OP_BUILD_STRING", chunk, offset, wide);
+    case OP_WIDE:
+      simple_instruction("OP_WIDE", offset);
+      return disassemble(chunk, offset + 1, true);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
 
+int disassemble_instruction(Chunk* chunk, int offset) {
+  return disassemble(chunk, offset, false);
+}
+
@@ -1,11 +1,15 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.hpp"
 #include "chunk.hpp"
 #include "debug.hpp"
+#include "memory.hpp"
 #include "vm.hpp"
 
+#define GC_OPTION_COUNT 5
+
 static void repl() {
   char line[1024];
   for (;;) {
@@ -50,15 +54,109 @@ static void run_file(const char* path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage() {
+  fprintf(stderr, "Usage: main [--heap-initial=SIZE] [--heap-min=SIZE] [--heap-max=SIZE] [--heap-growth=FACTOR] [--gc-threads=COUNT] [path]\n");
+  exit(64);
+}
+
+// Sizes are in bytes, with an optional k, m or g suffix. Anything too big for 
+// a size_t is rejected rather than wrapped.
+static bool parse_size(const char* text, size_t* size) {
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || *text == '-' || errno == ERANGE) return false;
+  int shift = 0;
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+  }
+  if (*end != '\0' || value > (SIZE_MAX >> shift)) return false;
+  value <<= shift;
+  *size = value;
+  return true;
+}
+
+static bool parse_count(const char* text, int* count) {
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < 1 || value > GC_THREADS_MAX) return false;
+  *count = static_cast<int>(value);
+  return true;
+}
+
+static bool parse_factor(const char* text, double* factor) {
+  char* end;
+  double value = strtod(text, &end);
+  if (end == text || *end != '\0' || !(value > 1)) return false;
+  *factor = value;
+  return true;
+}
+
+// The heap and collector settings, each with its command line option and 
+// the environment variable that sets it when the option isn't given.
+static const char* gc_options[][2] = {
+  {"heap-initial", "GC_HEAP_INITIAL"},
+  {"heap-min", "GC_HEAP_MIN"},
+  {"heap-max", "GC_HEAP_MAX"},
+  {"heap-growth", "GC_HEAP_GROWTH"},
+  {"gc-threads", "GC_THREADS"}
+};
+
+static bool set_gc_option(int option, const char* value) {
+  switch (option) {
+    case 0: return parse_size(value, &vm.next_gc);
+    case 1: return parse_size(value, &vm.heap_min);
+    case 2: return parse_size(value, &vm.heap_max);
+    case 3: return parse_factor(value, &vm.heap_grow_factor);
+    case 4: return parse_count(value, &vm.gc_threads);
+  }
+  return false;
+}
+
+static void read_gc_environment() {
+  for (int i = 0; i < GC_OPTION_COUNT; i++) {
+    const char* value = getenv(gc_options[i][1]);
+    if (value != nullptr && !set_gc_option(i, value)) {
+      fprintf(stderr, "Invalid value \"%s\" for %s.\n", value, gc_options[i][1]);
+      exit(64);
+    }
+  }
+}
+
+// Returns the index of the first argument that isn't a collector option.
+static int read_gc_options(int argc, const char* argv[]) {
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    const char* option = argv[arg] + 2;
+    const char* equals = strchr(option, '=');
+    if (equals == nullptr) usage();
+    size_t length = equals - option;
+    int i = 0;
+    while (i < GC_OPTION_COUNT && (strlen(gc_options[i][0]) != length || strncmp(option, gc_options[i][0], length) != 0)) {
+      i++;
+    }
+    if (i == GC_OPTION_COUNT || !set_gc_option(i, equals + 1)) usage();
+  }
+  return arg;
+}
+
 int main(int argc, const char* argv[]) {
+  read_gc_environment();
+  int arg = read_gc_options(argc, argv);
+  if (vm.heap_max != 0 && vm.heap_min > vm.heap_max) {
+    fprintf(stderr, "The minimum heap size can't be above the maximum.\n");
+    exit(64);
+  }
+
   run_file("stl.txt");
-  if (argc == 1) {
+  if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  } else if (arg == argc - 1) {
+    run_file(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: main [path]\n");
-    exit(64);
+    usage();
   }
   vm.clear();
   return 0;
@@ -45,6 +45,38 @@ bool Map::remove(Value key) {
   return true;
 }
 
+void Map::reserve(int new_count) {
+  int new_capacity = capacity;
+  while (new_count > new_capacity * MAP_MAX_LOAD) {
+    new_capacity = GROW_CAPACITY(new_capacity);
+  }
+  if (new_capacity > capacity) adjust_capacity(new_capacity);
+}
+
+// Object keys hash by address, so a map has to rebuild itself when the 
+// collector moves one of them. The size doesn't change, so this bypasses 
+// reallocate and can't start a collection of its own.
+void Map::rehash() {
+  MapEntry* old_entries = entries;
+  while ((entries = static_cast<MapEntry*>(resize_buffer(nullptr, 0, sizeof(MapEntry) * capacity))) == nullptr) {
+    out_of_memory();
+  }
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NIL_VAL;
+    entries[i].value = NIL_VAL;
+  }
+  count = 0;
+  for (int i = 0; i < capacity; i++) {
+    MapEntry* entry = &old_entries[i];
+    if (entry->key == NIL_VAL) continue;
+    MapEntry* dest = find_entry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    count++;
+  }
+  resize_buffer(old_entries, sizeof(MapEntry) * capacity, 0);
+}
+
 void Map::mark() {
   for (int i = 0; i < capacity; i++) {
     MapEntry* entry = &entries[i];
@@ -53,8 +85,15 @@ void Map::mark() {
   }
 }
 
+// Small doubles have no low bits set, so hashing their raw bits sent every
+// one to bucket 0. Ints hash to their own value and doubles are mixed.
+static uint32_t hash_value(Value key) {
+  if (IS_INT(key) || IS_OBJ(key)) return static_cast<uint32_t>(key);
+  return static_cast<uint32_t>((key * 0x9e3779b97f4a7c15) >> 32);
+}
+
 MapEntry* Map::find_entry(MapEntry* entries, int capacity, Value key) {
-  uint32_t index = key & (capacity - 1);
+  uint32_t index = hash_value(key) & (capacity - 1);
   MapEntry* tombstone = nullptr;
   for (;;) {
     MapEntry* entry = &entries[index];
@@ -20,6 +20,8 @@ public:
   bool get(Value key, Value* value);
   bool set(Value key, Value value);
   bool remove(Value key);
+  void reserve(int new_count);
+  void rehash();
   void mark();
 
 private:
@@ -1,42 +1,287 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <thread>
+#include <vector>
 #include "compiler.hpp"
 #include "nativeclass.hpp"
 #include "memory.hpp"
 #include "vm.hpp"
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(GC_COMPACT) && defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#ifdef GC_CONCURRENT_MARK
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.hpp"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#ifdef DEBUG_LOG_GC
+static size_t cycle_start_bytes;
+#endif
+
+// Sweeper threads count what they free on their own, and it is added to 
+// vm.bytes_allocated once they are all done.
+static thread_local size_t* byte_count = &vm.bytes_allocated;
+
+static size_t mapped_size(size_t size) {
+  static const size_t os_page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return (size + os_page_size - 1) & ~(os_page_size - 1);
+}
+
+static void* map_memory(size_t size) {
+  void* result = mmap(nullptr, mapped_size(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return result == MAP_FAILED ? nullptr : result;
+}
+
+// Buffers of LARGE_BUFFER_SIZE bytes or more get a mapping of their own, 
+// so they can grow without being copied and go straight back to the OS 
+// when they are freed. Unlike reallocate, this doesn't count bytes or 
+// collect, so the collector can use it too. Returns null if the memory 
+// can't be had, leaving the old buffer as it was.
+void* resize_buffer(void* pointer, size_t old_size, size_t new_size) {
+  bool was_mapped = old_size >= LARGE_BUFFER_SIZE;
+  bool mapped = new_size >= LARGE_BUFFER_SIZE;
+  if (new_size == 0) {
+    if (was_mapped) {
+      munmap(pointer, mapped_size(old_size));
+    } else {
+      free(pointer);
+    }
+    return nullptr;
+  }
+  if (!was_mapped && !mapped) return realloc(pointer, new_size);
+  if (was_mapped && mapped) {
+    if (mapped_size(old_size) == mapped_size(new_size)) return pointer;
+
+#ifdef __linux__
+    void* result = mremap(pointer, mapped_size(old_size), mapped_size(new_size), MREMAP_MAYMOVE);
+    return result == MAP_FAILED ? nullptr : result;
+#endif
+
+  }
+  void* result = mapped ? map_memory(new_size) : malloc(new_size);
+  if (result == nullptr) return nullptr;
+  if (old_size > 0) memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+  resize_buffer(pointer, old_size, 0);
+  return result;
+}
+
+// Past heap_max, a full collection gets one chance to make room. If it 
+// can't, the allocation still goes ahead, and the interpreter raises a 
+// runtime error at its next safepoint.
+static void check_heap_limit() {
+  if (vm.heap_max == 0 || vm.heap_exhausted || vm.bytes_allocated <= vm.heap_max) return;
+  collect_garbage();
+  if (vm.bytes_allocated > vm.heap_max) {
+    vm.heap_exhausted = true;
+    vm.gc_request = true;
+  }
+}
+
+static void free_pages(Page* page) {
+  while (page != nullptr) {
+    Page* next = page->next;
+    free(page);
+    page = next;
+  }
+}
+
+static void take_reserve() {
+  if (vm.memory_reserve == nullptr) vm.memory_reserve = resize_buffer(nullptr, 0, MEMORY_RESERVE_SIZE);
+}
+
+// Called on the main thread when the system allocator comes back empty. The 
+// first time, it gives back the reserve and the page pool for the caller to 
+// retry with, and flags the heap exhausted so the script stops with an out 
+// of memory error at its next safepoint. The reserve is taken again when a 
+// full collection finishes. Until then, or if the retry fails because the 
+// request is bigger than what was given back, there is nothing left to 
+// retry with and the process exits.
+void out_of_memory() {
+  if (vm.memory_reserve == nullptr) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  resize_buffer(vm.memory_reserve, MEMORY_RESERVE_SIZE, 0);
+  vm.memory_reserve = nullptr;
+  free_pages(vm.free_pages);
+  vm.free_pages = nullptr;
+  vm.free_page_count = 0;
+  vm.heap_exhausted = true;
+  vm.gc_request = true;
+}
 
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
-  vm.bytes_allocated += new_size - old_size;
+  *byte_count += new_size - old_size;
 
   if (new_size > old_size) {
 
 #ifdef DEBUG_STRESS_GC
-    collect_garbage();
+    gc_step();
 #endif
 
-    if (vm.bytes_allocated > vm.next_gc) {
-      collect_garbage();
+    if (vm.gc_phase != GC_IDLE || vm.bytes_allocated > vm.next_gc) {
+      gc_step();
     }
+    check_heap_limit();
   }
 
-  if (new_size == 0) {
-    free(pointer);
-    return nullptr;
+  void* result = resize_buffer(pointer, old_size, new_size);
+  if (result == nullptr && new_size > 0) {
+    // The system is out of memory, not just the heap limit. Collecting 
+    // everything might free enough to try again.
+    collect_garbage();
+    while ((result = resize_buffer(pointer, old_size, new_size)) == nullptr) out_of_memory();
   }
-  void* result = realloc(pointer, new_size);
-  if (result == nullptr) exit(1);
   return result;
 }
 
+void remember(Obj* object) {
+  if (vm.remembered_capacity < vm.remembered_count + 1) {
+    vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+    Obj** remembered;
+    while ((remembered = static_cast<Obj**>(realloc(vm.remembered, vm.remembered_capacity * sizeof(Obj*)))) == nullptr) out_of_memory();
+    vm.remembered = remembered;
+  }
+  object->is_remembered = true;
+  vm.remembered[vm.remembered_count++] = object;
+}
+
+static void push_gray(Obj* object) {
+  if (vm.gray_capacity < vm.gray_count + 1) {
+    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+    Obj** gray_stack;
+    while ((gray_stack = static_cast<Obj**>(realloc(vm.gray_stack, vm.gray_capacity * sizeof(Obj*)))) == nullptr) out_of_memory();
+    vm.gray_stack = gray_stack;
+  }
+  vm.gray_stack[vm.gray_count++] = object;
+}
+
+// During a parallel trace each thread owns one of these Chase-Lev deques.
+// The owner pushes and pops at the bottom without locking, and idle 
+// threads steal from the top with a compare and swap. A full deque grows 
+// into a new array, and the old one is kept until the trace is over since 
+// a thief may still be reading it.
+struct GrayArray {
+  int64_t capacity;
+  std::atomic<Obj*>* items;
+};
+
+struct GrayDeque {
+  std::atomic<int64_t> top;
+  std::atomic<int64_t> bottom;
+  std::atomic<GrayArray*> array;
+  std::vector<GrayArray*> retired;
+};
+
+static std::vector<GrayDeque> gray_deques;
+static std::atomic<int> idle_markers;
+static thread_local GrayDeque* own_deque = nullptr;
+
+// This runs on the tracing threads, which can't take the reserve, so it is 
+// one of the few places running out of memory still ends the process.
+static GrayArray* new_gray_array(int64_t capacity) {
+  GrayArray* array = static_cast<GrayArray*>(malloc(sizeof(GrayArray)));
+  if (array == nullptr) exit(1);
+  array->capacity = capacity;
+  array->items = static_cast<std::atomic<Obj*>*>(malloc(capacity * sizeof(std::atomic<Obj*>)));
+  if (array->items == nullptr) exit(1);
+  return array;
+}
+
+static void free_gray_array(GrayArray* array) {
+  free(array->items);
+  free(array);
+}
+
+static void deque_push(GrayDeque* deque, Obj* object) {
+  int64_t bottom = deque->bottom.load(std::memory_order_relaxed);
+  int64_t top = deque->top.load(std::memory_order_acquire);
+  GrayArray* array = deque->array.load(std::memory_order_relaxed);
+  if (bottom - top > array->capacity - 1) {
+    GrayArray* grown = new_gray_array(array->capacity * 2);
+    for (int64_t i = top; i < bottom; i++) {
+      Obj* item = array->items[i % array->capacity].load(std::memory_order_relaxed);
+      grown->items[i % grown->capacity].store(item, std::memory_order_relaxed);
+    }
+    deque->retired.push_back(array);
+    deque->array.store(grown, std::memory_order_release);
+    array = grown;
+  }
+  array->items[bottom % array->capacity].store(object, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  deque->bottom.store(bottom + 1, std::memory_order_relaxed);
+}
+
+// Only the owner pops. When one object is left, the owner and a thief race
+// for it on top.
+static Obj* deque_pop(GrayDeque* deque) {
+  int64_t bottom = deque->bottom.load(std::memory_order_relaxed) - 1;
+  GrayArray* array = deque->array.load(std::memory_order_relaxed);
+  deque->bottom.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = deque->top.load(std::memory_order_relaxed);
+  if (top > bottom) {
+    deque->bottom.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  Obj* object = array->items[bottom % array->capacity].load(std::memory_order_relaxed);
+  if (top == bottom) {
+    if (!deque->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      object = nullptr;
+    }
+    deque->bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return object;
+}
+
+static bool deque_empty(GrayDeque* deque) {
+  int64_t top = deque->top.load(std::memory_order_acquire);
+  return deque->bottom.load(std::memory_order_acquire) <= top;
+}
+
+// Takes the oldest object, the one its owner would get to last. Returns 
+// null if the deque is empty or another thread got there first.
+static Obj* steal(GrayDeque* victim) {
+  int64_t top = victim->top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t bottom = victim->bottom.load(std::memory_order_acquire);
+  if (top >= bottom) return nullptr;
+  GrayArray* array = victim->array.load(std::memory_order_acquire);
+  Obj* object = array->items[top % array->capacity].load(std::memory_order_relaxed);
+  if (!victim->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return object;
+}
+
 void mark_object(Obj* object) {
   if (object == nullptr) return;
-  if (object->is_marked) return;
+  uint64_t bit;
+  uint64_t* word = mark_word(object, &bit);
+  if (own_deque != nullptr) {
+    if (std::atomic_ref<uint64_t>(*word).fetch_or(bit, std::memory_order_relaxed) & bit) return;
+    deque_push(own_deque, object);
+    return;
+  }
+  if (*word & bit) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
@@ -44,13 +289,22 @@ void mark_object(Obj* object) {
   printf("\n");
 #endif
 
-  object->is_marked = true;
-  if (vm.gray_capacity < vm.gray_count + 1) {
-    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-    vm.gray_stack = static_cast<Obj**>(realloc(vm.gray_stack, vm.gray_capacity * sizeof(Obj*)));
-    if (vm.gray_stack == nullptr) exit(1);
+  *word |= bit;
+  push_gray(object);
+}
+
+void rescan_object(Obj* object) {
+  push_gray(object);
+}
+
+void revive_string(ObjString* string) {
+  if (vm.revived_capacity < vm.revived_count + 1) {
+    vm.revived_capacity = GROW_CAPACITY(vm.revived_capacity);
+    Obj** revived;
+    while ((revived = static_cast<Obj**>(realloc(vm.revived, vm.revived_capacity * sizeof(Obj*)))) == nullptr) out_of_memory();
+    vm.revived = revived;
   }
-  vm.gray_stack[vm.gray_count++] = object;
+  vm.revived[vm.revived_count++] = string;
 }
 
 void mark_value(Value value) {
@@ -82,6 +336,7 @@ static void blacken_object(Obj* object) {
       ObjClass* klass = static_cast<ObjClass*>(object);
       mark_object(static_cast<Obj*>(klass->name));
       klass->methods.mark();
+      klass->field_slots.mark();
       break;
     }
     case OBJ_CLOSURE: {
@@ -90,6 +345,9 @@ static void blacken_object(Obj* object) {
       for (int i = 0; i < closure->upvalue_count; i++) {
         mark_object(static_cast<Obj*>(closure->upvalues[i]));
       }
+      for (int i = 0; i < closure->capture_count; i++) {
+        mark_value(closure->captures[i]);
+      }
       break;
     }
     case OBJ_FUNCTION: {
@@ -102,6 +360,9 @@ static void blacken_object(Obj* object) {
       ObjInstance* instance = static_cast<ObjInstance*>(object);
       mark_object(static_cast<Obj*>(instance->klass));
       instance->fields.mark();
+      for (int i = 0; i < instance->field_count; i++) {
+        mark_value(instance->field_values[i]);
+      }
       break;
     }
     case OBJ_UPVALUE:
@@ -129,71 +390,671 @@ static void blacken_object(Obj* object) {
   }
 }
 
-static void free_object(Obj* object) {
+static size_t object_size(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = static_cast<ObjClosure*>(object);
+      return closure_size(closure->upvalue_count, closure->capture_count);
+    }
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_INSTANCE: return instance_size(static_cast<ObjInstance*>(object)->field_count);
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    case OBJ_NATIVE_INSTANCE:
+      switch (static_cast<ObjNativeInstance*>(object)->native_type) {
+        case NATIVE_LIST: return sizeof(ObjNativeList);
+        case NATIVE_MAP: return sizeof(ObjNativeMap);
+      }
+      break;
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_STRING: return string_size(static_cast<ObjString*>(object)->length);
+  }
+  return 0;
+}
+
+// Releases the buffers an object owns, but not the object itself, which may 
+// live in the nursery.
+static void free_contents(Obj* object) {
+  switch (object->type) {
+    case OBJ_CLASS: {
+      ObjClass* klass = static_cast<ObjClass*>(object);
+      klass->methods.clear();
+      klass->field_slots.clear();
+      break;
+    }
+    case OBJ_FUNCTION:
+      static_cast<ObjFunction*>(object)->chunk.clear();
+      break;
+    case OBJ_INSTANCE:
+      static_cast<ObjInstance*>(object)->fields.clear();
+      break;
+    case OBJ_NATIVE_INSTANCE: {
+      ObjNativeInstance* instance = static_cast<ObjNativeInstance*>(object);
+      switch (instance->native_type) {
+        case NATIVE_LIST:
+          static_cast<ObjNativeList*>(instance)->list.clear();
+          break;
+        case NATIVE_MAP:
+          static_cast<ObjNativeMap*>(instance)->map.clear();
+          break;
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD:
+    case OBJ_CLOSURE:
+    case OBJ_UPVALUE:
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static const int small_cell_sizes[SMALL_CLASS_COUNT] = {
+  16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 
+  448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096
+};
+
+// Past 4 KiB, each class is the biggest cell that fits n to a page, for n 
+// from 15 down to 2, so medium objects share pages and leave no tail unused.
+static int cell_sizes[SIZE_CLASS_COUNT];
+
+// Indexed by size in 8-byte units, rounded up.
+static uint8_t size_class_of[MAX_CELL_SIZE / 8 + 1];
+
+void init_heap() {
+  for (int i = 0; i < SMALL_CLASS_COUNT; i++) cell_sizes[i] = small_cell_sizes[i];
+  for (int i = SMALL_CLASS_COUNT, per_page = 15; i < SIZE_CLASS_COUNT; i++, per_page--) {
+    cell_sizes[i] = static_cast<int>(((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / per_page) & ~static_cast<size_t>(15));
+  }
+  int size_class = 0;
+  for (size_t units = 0; units <= MAX_CELL_SIZE / 8; units++) {
+    while (static_cast<size_t>(cell_sizes[size_class]) < units * 8) size_class++;
+    size_class_of[units] = static_cast<uint8_t>(size_class);
+  }
+  for (int i = 0; i <= SIZE_CLASS_COUNT; i++) {
+    SizeClass* cls = &vm.size_classes[i];
+    cls->available = nullptr;
+    cls->full = nullptr;
+    cls->unswept = nullptr;
+  }
+  vm.free_pages = nullptr;
+  vm.free_page_count = 0;
+  vm.memory_reserve = nullptr;
+  take_reserve();
+}
+
+static inline int page_words(Page* page) {
+  return (page->cell_count + 63) / 64;
+}
+
+static void push_page(Page** list, Page* page) {
+  page->next = *list;
+  *list = page;
+}
+
+// Calls f on every object in the page.
+static void walk_page(Page* page, void (*f)(Obj*)) {
+  for (int word = 0; word < page_words(page); word++) {
+    for (uint64_t cells = page->allocated[word]; cells != 0; cells &= cells - 1) {
+      f(page_cell(page, word * 64 + std::countr_zero(cells)));
+    }
+  }
+}
+
+// Calls f on every old object.
+static void walk_pages(void (*f)(Obj*)) {
+  for (SizeClass& cls : vm.size_classes) {
+    for (Page* list : {cls.available, cls.full, cls.unswept}) {
+      for (Page* page = list; page != nullptr; page = page->next) {
+        walk_page(page, f);
+      }
+    }
+  }
+}
+
+// Frees the dead objects on a page and clears its marks. After a concurrent 
+// mark it is the condemned objects that are marked rather than the live 
+// ones. Only the dead objects themselves are touched.
+static void sweep_page(Page* page) {
+  for (int word = 0; word < page_words(page); word++) {
+    uint64_t dead = page->allocated[word] & (vm.sweep_condemned ? page->marked[word] : ~page->marked[word]);
+    if (dead == 0) continue;
+    for (uint64_t cells = dead; cells != 0; cells &= cells - 1) {
+      Obj* object = page_cell(page, word * 64 + std::countr_zero(cells));
 
 #ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void*)object, object->type);
+      printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
+      free_contents(object);
+    }
+    int count = std::popcount(dead);
+    page->allocated[word] &= ~dead;
+    page->live_count -= count;
+    *byte_count -= static_cast<size_t>(count) * page->cell_size;
+  }
+  memset(page->marked, 0, page_words(page) * sizeof(uint64_t));
+  page->first_free_word = 0;
+}
+
+// Large objects are too big to share a page, so each gets a mapping sized 
+// to fit it. The mapping is taken oversized and trimmed down to the aligned 
+// part, which keeps it out of malloc's heap and wastes less than an OS page.
+static Page* allocate_large_page(size_t size) {
+  size_t length = mapped_size(size);
+  char* memory;
+  while ((memory = static_cast<char*>(map_memory(length + HEAP_PAGE_SIZE))) == nullptr) out_of_memory();
+  char* start = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(memory) + HEAP_PAGE_SIZE - 1) & ~static_cast<uintptr_t>(HEAP_PAGE_SIZE - 1));
+  if (start > memory) munmap(memory, start - memory);
+  munmap(start + length, memory + HEAP_PAGE_SIZE - start);
+  return reinterpret_cast<Page*>(start);
+}
+
+static void free_large_page(Page* page) {
+  munmap(page, mapped_size(PAGE_HEADER_SIZE + page->cell_size));
+}
+
+// Puts a swept page back where allocation can find it. Empty pages go to 
+// the pool, except large ones, which are only ever used once.
+static void file_page(Page* page) {
+  SizeClass* cls = &vm.size_classes[page->size_class];
+  if (page->live_count == 0) {
+    if (page->size_class == LARGE_CLASS) {
+      free_large_page(page);
+    } else {
+      push_page(&vm.free_pages, page);
+      vm.free_page_count++;
+    }
+  } else if (page->live_count == page->cell_count) {
+    push_page(&cls->full, page);
+  } else {
+    push_page(&cls->available, page);
+  }
+}
+
+static Page* new_page(int size_class) {
+  Page* page = vm.free_pages;
+  if (page != nullptr) {
+    vm.free_pages = page->next;
+    vm.free_page_count--;
+  } else {
+    while ((page = static_cast<Page*>(aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE))) == nullptr) out_of_memory();
+  }
+  page->size_class = size_class;
+  page->cell_size = cell_sizes[size_class];
+  page->cell_count = static_cast<int>((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / page->cell_size);
+  page->live_count = 0;
+  page->first_free_word = 0;
+  page->evacuated = false;
+  page->cell_reciprocal = static_cast<uint32_t>(((UINT64_C(1) << 32) + page->cell_size - 1) / page->cell_size);
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marked, 0, sizeof(page->marked));
+  push_page(&vm.size_classes[size_class].available, page);
+  return page;
+}
+
+static Obj* allocate_large(size_t size) {
+  Page* page = allocate_large_page(PAGE_HEADER_SIZE + size);
+  page->size_class = LARGE_CLASS;
+  page->cell_size = static_cast<int>(size);
+  page->cell_count = 1;
+  page->live_count = 1;
+  page->first_free_word = 0;
+  page->evacuated = false;
+  page->cell_reciprocal = 0;
+  page->allocated[0] = 1;
+  page->marked[0] = 0;
+  push_page(&vm.size_classes[LARGE_CLASS].full, page);
+  *byte_count += size;
+  return page_cell(page, 0);
+}
+
+// Finds a cell for an old object. Pages still waiting to be swept are swept 
+// here, on demand, before a new page is taken.
+static Obj* allocate_cell(size_t size) {
+  if (size > MAX_CELL_SIZE) return allocate_large(size);
+  int size_class = size_class_of[(size + 7) / 8];
+  SizeClass* cls = &vm.size_classes[size_class];
+  Page* page;
+  for (;;) {
+    page = cls->available;
+    if (page == nullptr) {
+      if (cls->unswept == nullptr) {
+        page = new_page(size_class);
+        break;
+      }
+      page = cls->unswept;
+      cls->unswept = page->next;
+      sweep_page(page);
+      file_page(page);
+      continue;
+    }
+    if (page->live_count < page->cell_count) break;
+    cls->available = page->next;
+    push_page(&cls->full, page);
+  }
+
+  int word = page->first_free_word;
+  while (page->allocated[word] == ~UINT64_C(0)) word++;
+  int bit = std::countr_zero(~page->allocated[word]);
+  page->allocated[word] |= UINT64_C(1) << bit;
+  page->first_free_word = word;
+  page->live_count++;
+  *byte_count += page->cell_size;
+  return page_cell(page, word * 64 + bit);
+}
+
+static void trim_page_pool() {
+  while (vm.free_page_count > PAGE_POOL_PAGES) {
+    Page* page = vm.free_pages;
+    vm.free_pages = page->next;
+    vm.free_page_count--;
+    free(page);
+  }
+}
+
+static void* allocate_old(size_t size) {
+  if (vm.gc_phase != GC_IDLE || vm.bytes_allocated > vm.next_gc) {
+    gc_step();
+  }
+  check_heap_limit();
+  return allocate_cell(size);
+}
+
+// Small objects are bump allocated in the nursery. Anything that doesn't 
+// fit goes straight to the old generation and asks for a minor collection 
+// at the next safepoint.
+void* allocate_object(size_t size) {
+
+#ifdef DEBUG_STRESS_GC
+  gc_step();
+  vm.gc_request = true;
+#endif
+
+  size_t aligned = (size + 7) & ~static_cast<size_t>(7);
+  if (aligned > static_cast<size_t>(vm.nursery + NURSERY_SIZE - vm.nursery_top)) {
+    vm.gc_request = true;
+    return allocate_old(size);
+  }
+  void* result = vm.nursery_top;
+  vm.nursery_top += aligned;
+  return result;
+}
+
+// Calls f on every object in the nursery, in allocation order.
+static void walk_nursery(void (*f)(Obj*)) {
+  char* cursor = vm.nursery;
+  while (cursor < vm.nursery_top) {
+    Obj* object = reinterpret_cast<Obj*>(cursor);
+    cursor += (object_size(object) + 7) & ~static_cast<size_t>(7);
+    f(object);
+  }
+}
+
+using MoveFn = Obj*(*)(Obj* object);
+
+static void clear_nursery_marks() {
+  memset(vm.nursery_marks, 0, NURSERY_SIZE / 8 / 64 * sizeof(uint64_t));
+}
+
+// Points a copy's references into itself at its own memory rather than at 
+// the original's.
+static void relocate(Obj* object, Obj* copy) {
   switch (object->type) {
-    case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = static_cast<ObjClosure*>(copy);
+      closure->captures = reinterpret_cast<Value*>(closure + 1);
+      closure->upvalues = reinterpret_cast<ObjUpvalue**>(closure->captures + closure->capture_count);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = static_cast<ObjInstance*>(copy);
+      instance->field_values = reinterpret_cast<Value*>(instance + 1);
       break;
+    }
+    case OBJ_STRING: {
+      ObjString* string = static_cast<ObjString*>(copy);
+      string->chars = reinterpret_cast<char*>(string + 1);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(copy);
+      if (upvalue->location == &static_cast<ObjUpvalue*>(object)->closed) {
+        upvalue->location = &upvalue->closed;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Copies a young object into the old generation the first time it is 
+// reached and leaves the address of the copy behind in next.
+static Obj* promote(Obj* object) {
+  if (object == nullptr || !is_young(object)) return object;
+  if (object->next != nullptr) return object->next;
+
+  size_t size = object_size(object);
+  Obj* copy = allocate_cell(size);
+  memcpy(static_cast<void*>(copy), object, size);
+  relocate(object, copy);
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif
+
+  // An incremental major cycle may already have marked it.
+  if (is_marked(object)) set_mark(copy, true);
+
+  object->next = copy;
+  push_gray(copy);
+  return copy;
+}
+
+static void move_value(Value* slot, MoveFn move) {
+  if (IS_OBJ(*slot)) *slot = OBJ_VAL(move(AS_OBJ(*slot)));
+}
+
+static void move_array(ValueArray* array, MoveFn move) {
+  for (int i = 0; i < array->count; i++) {
+    move_value(&array->values[i], move);
+  }
+}
+
+// Table keys hash by their characters, so they can move in place.
+static void move_table(Table* table, MoveFn move) {
+  for (int i = 0; i < table->capacity; i++) {
+    TableEntry* entry = &table->entries[i];
+    entry->key = static_cast<ObjString*>(move(entry->key));
+    move_value(&entry->value, move);
+  }
+}
+
+static void move_map(Map* map, MoveFn move) {
+  bool moved = false;
+  for (int i = 0; i < map->capacity; i++) {
+    MapEntry* entry = &map->entries[i];
+    Value key = entry->key;
+    move_value(&entry->key, move);
+    moved |= entry->key != key;
+    move_value(&entry->value, move);
+  }
+  if (moved) map->rehash();
+}
+
+// Runs every reference the object holds through move.
+static void scan_object(Obj* object, MoveFn move) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = static_cast<ObjBoundMethod*>(object);
+      move_value(&bound->receiver, move);
+      bound->method = static_cast<ObjClosure*>(move(bound->method));
+      break;
+    }
     case OBJ_CLASS: {
       ObjClass* klass = static_cast<ObjClass*>(object);
-      klass->methods.clear();
-      FREE(ObjClass, object);
+      klass->name = static_cast<ObjString*>(move(klass->name));
+      move_table(&klass->methods, move);
+      move_table(&klass->field_slots, move);
       break;
-    } 
+    }
     case OBJ_CLOSURE: {
       ObjClosure* closure = static_cast<ObjClosure*>(object);
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-      FREE(ObjClosure, object);
+      closure->function = static_cast<ObjFunction*>(move(closure->function));
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        closure->upvalues[i] = static_cast<ObjUpvalue*>(move(closure->upvalues[i]));
+      }
+      for (int i = 0; i < closure->capture_count; i++) {
+        move_value(&closure->captures[i], move);
+      }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = static_cast<ObjFunction*>(object);
-      function->chunk.clear();
-      FREE(ObjFunction, object);
+      function->name = static_cast<ObjString*>(move(function->name));
+      move_array(&function->chunk.constants, move);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = static_cast<ObjInstance*>(object);
-      instance->fields.clear();
-      FREE(ObjInstance, object);
+      instance->klass = static_cast<ObjClass*>(move(instance->klass));
+      move_table(&instance->fields, move);
+      for (int i = 0; i < instance->field_count; i++) {
+        move_value(&instance->field_values[i], move);
+      }
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      move_value(&static_cast<ObjUpvalue*>(object)->closed, move);
       break;
     case OBJ_NATIVE_INSTANCE: {
       ObjNativeInstance* instance = static_cast<ObjNativeInstance*>(object);
       switch (instance->native_type) {
-        case NATIVE_LIST: {
-          ObjNativeList* list = static_cast<ObjNativeList*>(instance);
-          list->list.clear();
-          FREE(ObjNativeList, list);
+        case NATIVE_LIST:
+          move_array(&static_cast<ObjNativeList*>(instance)->list, move);
           break;
-        }
-        case NATIVE_MAP: {
-          ObjNativeMap* map = static_cast<ObjNativeMap*>(instance);
-          map->map.clear();
-          FREE(ObjNativeMap, map);
+        case NATIVE_MAP:
+          move_map(&static_cast<ObjNativeMap*>(instance)->map, move);
           break;
-        }
       }
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
-      break;
-    case OBJ_STRING: {
-      ObjString* string = static_cast<ObjString*>(object);
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+    case OBJ_STRING:
       break;
+  }
+}
+
+static void free_unpromoted(Obj* object) {
+  if (object->next == nullptr) free_contents(object);
+}
+
+static void move_roots(MoveFn move) {
+  for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+    move_value(slot, move);
+  }
+  for (int i = 0; i < vm.frame_count; i++) {
+    vm.frames[i].closure = static_cast<ObjClosure*>(move(vm.frames[i].closure));
+  }
+  for (ObjUpvalue** upvalue = &vm.open_upvalues; *upvalue != nullptr; upvalue = &(*upvalue)->next) {
+    *upvalue = static_cast<ObjUpvalue*>(move(*upvalue));
+  }
+  move_table(&vm.globals, move);
+  vm.list_class = static_cast<ObjString*>(move(vm.list_class));
+  vm.list_field = static_cast<ObjString*>(move(vm.list_field));
+  vm.map_class = static_cast<ObjString*>(move(vm.map_class));
+  vm.map_field = static_cast<ObjString*>(move(vm.map_field));
+  vm.iter_string = static_cast<ObjString*>(move(vm.iter_string));
+  vm.next_string = static_cast<ObjString*>(move(vm.next_string));
+}
+
+#ifdef GC_COMPACT
+
+// How many of a size class's pages could be emptied by packing its objects 
+// into as few pages as possible.
+static int spare_pages(SizeClass* cls, int* page_count) {
+  int live = 0;
+  int pages = 0;
+  int cell_count = 0;
+  for (Page* list : {cls->available, cls->full}) {
+    for (Page* page = list; page != nullptr; page = page->next) {
+      live += page->live_count;
+      cell_count = page->cell_count;
+      pages++;
     }
   }
+  *page_count = pages;
+  if (pages == 0) return 0;
+  return pages - (live + cell_count - 1) / cell_count;
+}
+
+// Asks for a compaction at the next safepoint once the pages that packing 
+// would empty make up GC_COMPACT_FRAGMENTATION percent of the old generation.
+static void request_compaction() {
+  int spare = 0;
+  int total = 0;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    int pages;
+    spare += spare_pages(&vm.size_classes[i], &pages);
+    total += pages;
+  }
+  if (spare > 0 && spare * 100 >= total * GC_COMPACT_FRAGMENTATION) {
+    vm.compact_request = true;
+    vm.gc_request = true;
+  }
+}
+
+static bool sparser(Page* a, Page* b) {
+  return a->live_count < b->live_count;
+}
+
+static Obj* forward(Obj* object) {
+  if (object == nullptr || is_young(object) || !page_of(object)->evacuated) return object;
+  return object->next;
+}
+
+static void forward_references(Obj* object) {
+  scan_object(object, forward);
+}
+
+// Moves the objects out of each size class's sparsest pages into the free 
+// cells of the rest, then updates every reference to them. Like a minor 
+// collection this only happens at a safepoint, with the nursery empty, so 
+// the roots are the same ones and no compiler is running.
+static void compact() {
+  std::vector<Page*> evacuated;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass* cls = &vm.size_classes[i];
+    int page_count;
+    int spare = spare_pages(cls, &page_count);
+    if (spare == 0) continue;
+
+    std::vector<Page*> pages;
+    for (Page* list : {cls->available, cls->full}) {
+      for (Page* page = list; page != nullptr; page = page->next) {
+        pages.push_back(page);
+      }
+    }
+    std::sort(pages.begin(), pages.end(), sparser);
+    cls->available = nullptr;
+    cls->full = nullptr;
+    for (int j = 0; j < page_count; j++) {
+      if (j < spare) {
+        pages[j]->evacuated = true;
+        evacuated.push_back(pages[j]);
+      } else {
+        file_page(pages[j]);
+      }
+    }
+  }
+  if (evacuated.empty()) return;
+
+  // The pages that stay have room for everything, so this never takes a 
+  // new page.
+  size_t moved = 0;
+  for (Page* page : evacuated) {
+    for (int word = 0; word < page_words(page); word++) {
+      for (uint64_t cells = page->allocated[word]; cells != 0; cells &= cells - 1) {
+        Obj* object = page_cell(page, word * 64 + std::countr_zero(cells));
+        size_t size = object_size(object);
+        Obj* copy = allocate_cell(size);
+        memcpy(static_cast<void*>(copy), object, size);
+        relocate(object, copy);
+        object->next = copy;
+        moved++;
+      }
+    }
+  }
+
+  move_roots(forward);
+  move_table(&vm.strings, forward);
+  walk_pages(forward_references);
+
+  // The copies own the buffers now, so the old cells are dropped as they are.
+  for (Page* page : evacuated) {
+    vm.bytes_allocated -= static_cast<size_t>(page->live_count) * page->cell_size;
+    push_page(&vm.free_pages, page);
+    vm.free_page_count++;
+  }
+  trim_page_pool();
+
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact moved %zu objects and emptied %zu pages\n", moved, evacuated.size());
+#endif
+}
+
+#endif
+
+// A minor collection moves objects, so it only runs at the interpreter's 
+// safepoints. Whatever survives is promoted straight to the old generation, 
+// which leaves the nursery empty again.
+void collect_nursery() {
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytes_allocated;
+#endif
+
+  // Copies are scanned off the top of the gray stack, above any entries an 
+  // unfinished major cycle still has there.
+  int marking = vm.gray_count;
+  move_roots(promote);
+  for (int i = 0; i < vm.remembered_count; i++) {
+    vm.remembered[i]->is_remembered = false;
+    scan_object(vm.remembered[i], promote);
+  }
+  vm.remembered_count = 0;
+  while (vm.gray_count > marking) {
+    scan_object(vm.gray_stack[--vm.gray_count], promote);
+  }
+
+  // Gray objects left over from an incremental major cycle may have moved 
+  // or died.
+  int gray_count = 0;
+  for (int i = 0; i < marking; i++) {
+    Obj* object = vm.gray_stack[i];
+    if (is_young(object)) {
+      if (object->next == nullptr) continue;
+      object = object->next;
+    }
+    vm.gray_stack[gray_count++] = object;
+  }
+  vm.gray_count = gray_count;
+
+  for (int i = 0; i < vm.strings.capacity; i++) {
+    TableEntry* entry = &vm.strings.entries[i];
+    if (entry->key == nullptr || !is_young(entry->key)) continue;
+    if (entry->key->next != nullptr) {
+      entry->key = static_cast<ObjString*>(entry->key->next);
+    } else {
+      vm.strings.remove(entry->key);
+    }
+  }
+  walk_nursery(free_unpromoted);
+  vm.nursery_top = vm.nursery;
+  clear_nursery_marks();
+  vm.gc_request = false;
+
+#ifdef GC_COMPACT
+  if (vm.compact_request && vm.gc_phase == GC_IDLE) compact();
+  vm.compact_request = false;
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+
+  if (vm.gc_phase != GC_IDLE || vm.bytes_allocated > vm.next_gc) {
+    gc_step();
+  }
+  check_heap_limit();
 }
 
 static void mark_roots() {
@@ -207,67 +1068,431 @@ static void mark_roots() {
     mark_object(static_cast<Obj*>(upvalue));
   }
   vm.globals.mark();
+  mark_object(static_cast<Obj*>(vm.list_class));
+  mark_object(static_cast<Obj*>(vm.list_field));
+  mark_object(static_cast<Obj*>(vm.map_class));
+  mark_object(static_cast<Obj*>(vm.map_field));
+  mark_object(static_cast<Obj*>(vm.iter_string));
+  mark_object(static_cast<Obj*>(vm.next_string));
   mark_compiler_roots();
 }
 
+// A thread that runs out of work keeps trying to steal until every thread 
+// is out of work. A thread only goes idle with an empty deque, and nothing 
+// else fills it, so once all of them are idle the trace is done.
+static void mark_worker(int id) {
+  int count = static_cast<int>(gray_deques.size());
+  own_deque = &gray_deques[id];
+  for (;;) {
+    Obj* object;
+    while ((object = deque_pop(own_deque)) != nullptr) {
+      blacken_object(object);
+    }
+    Obj* stolen = nullptr;
+    for (int i = 1; i < count && stolen == nullptr; i++) {
+      stolen = steal(&gray_deques[(id + i) % count]);
+    }
+    if (stolen != nullptr) {
+      blacken_object(stolen);
+      continue;
+    }
+
+    idle_markers++;
+    for (;;) {
+      if (idle_markers.load() == count) {
+        own_deque = nullptr;
+        return;
+      }
+      bool found = false;
+      for (int i = 1; i < count && !found; i++) {
+        found = !deque_empty(&gray_deques[(id + i) % count]);
+      }
+      if (found) break;
+      std::this_thread::yield();
+    }
+    idle_markers--;
+  }
+}
+
+static void trace_parallel() {
+  int count = vm.gc_threads;
+  gray_deques = std::vector<GrayDeque>(count);
+  for (GrayDeque& deque : gray_deques) {
+    deque.top = 0;
+    deque.bottom = 0;
+    deque.array = new_gray_array(GRAY_DEQUE_CAPACITY);
+  }
+  for (int i = 0; i < vm.gray_count; i++) {
+    deque_push(&gray_deques[i % count], vm.gray_stack[i]);
+  }
+  vm.gray_count = 0;
+  idle_markers = 0;
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < count; i++) {
+    threads.emplace_back(mark_worker, i);
+  }
+  mark_worker(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (GrayDeque& deque : gray_deques) {
+    free_gray_array(deque.array);
+    for (GrayArray* array : deque.retired) free_gray_array(array);
+  }
+  gray_deques.clear();
+}
+
+// The stop-the-world traces, as opposed to incremental steps, can spread the 
+// work over gc_threads threads.
 static void trace_references() {
+  if (vm.gc_threads > 1 && vm.gray_count > 0) {
+    trace_parallel();
+    return;
+  }
   while (vm.gray_count > 0) {
     Obj* object = vm.gray_stack[--vm.gray_count];
     blacken_object(object);
   }
 }
 
-static void sweep() {
-  Obj* previous = nullptr;
-  Obj* object = vm.objects;
-  while (object != nullptr) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != nullptr) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-      free_object(unreached);
+static void prune_remembered(bool condemned) {
+  int remembered_count = 0;
+  for (int i = 0; i < vm.remembered_count; i++) {
+    if (is_marked(vm.remembered[i]) != condemned) vm.remembered[remembered_count++] = vm.remembered[i];
+  }
+  vm.remembered_count = remembered_count;
+}
+
+// Every page goes on its class's unswept list, to be swept either by gc_step 
+// or by the first allocation that needs a cell from it.
+static void begin_sweep() {
+  for (SizeClass& cls : vm.size_classes) {
+    Page** tail = &cls.available;
+    while (*tail != nullptr) tail = &(*tail)->next;
+    *tail = cls.full;
+    cls.unswept = cls.available;
+    cls.available = nullptr;
+    cls.full = nullptr;
+  }
+  vm.gc_phase = GC_SWEEP;
+}
+
+#ifdef GC_CONCURRENT_MARK
+
+static void write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      _exit(1);
     }
+    data += written;
+    size -= written;
   }
 }
 
-void collect_garbage() {
+static int report_fd;
+static Obj* report_batch[512];
+static int report_count;
+
+static void report_unmarked(Obj* object) {
+  if (is_marked(object)) return;
+  report_batch[report_count++] = object;
+  if (report_count == 512) {
+    write_all(report_fd, reinterpret_cast<char*>(report_batch), sizeof(report_batch));
+    report_count = 0;
+  }
+}
+
+// Runs in the forked child, whose copy-on-write image of the heap is frozen 
+// at the moment of the fork. It sends back the old objects it couldn't reach.
+static void run_marker(int fd) {
+  // Starting threads after a fork is only safe in a single-threaded parent, 
+  // so the child marks on its own regardless of vm.gc_threads.
+  vm.gc_threads = 1;
+  mark_roots();
+  trace_references();
+  report_fd = fd;
+  report_count = 0;
+  walk_pages(report_unmarked);
+  write_all(fd, reinterpret_cast<char*>(report_batch), report_count * sizeof(Obj*));
+  fflush(stdout);
+  _exit(0);
+}
+
+// Anything unreachable in the snapshot stays unreachable. Nothing is swept 
+// until the marker is done, so the cells it reports can't be reused before 
+// then, and objects allocated meanwhile are never among them.
+static bool start_marker() {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run_marker(fds[1]);
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  vm.marker_pid = pid;
+  vm.marker_fd = fds[0];
+  vm.condemned_bytes = 0;
+  vm.gc_phase = GC_CONCURRENT;
+  return true;
+}
+
+// Collects what the marker has sent so far, and returns true once it has 
+// sent everything.
+static bool read_marker(bool wait) {
+  for (;;) {
+    if (vm.condemned_capacity - vm.condemned_bytes < 4096) {
+      vm.condemned_capacity = vm.condemned_capacity < 4096 ? 8192 : vm.condemned_capacity * 2;
+      Obj** condemned;
+      while ((condemned = static_cast<Obj**>(realloc(vm.condemned, vm.condemned_capacity))) == nullptr) out_of_memory();
+      vm.condemned = condemned;
+    }
+    char* end = reinterpret_cast<char*>(vm.condemned) + vm.condemned_bytes;
+    ssize_t bytes = read(vm.marker_fd, end, vm.condemned_capacity - vm.condemned_bytes);
+    if (bytes > 0) {
+      vm.condemned_bytes += bytes;
+    } else if (bytes == 0) {
+      return true;
+    } else if (errno == EAGAIN) {
+      if (!wait) return false;
+      struct pollfd marker = {vm.marker_fd, POLLIN, 0};
+      poll(&marker, 1, -1);
+    } else if (errno != EINTR) {
+      return true;
+    }
+  }
+}
+
+static void finish_concurrent_mark() {
+  int status;
+  while (waitpid(vm.marker_pid, &status, 0) < 0 && errno == EINTR) {}
+  close(vm.marker_fd);
+  vm.marker_pid = -1;
+  vm.marker_fd = -1;
+  // A marker that didn't finish may have sent a partial list. Every entry 
+  // would still be garbage, but it isn't worth trusting.
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) vm.condemned_bytes = 0;
+
+  size_t count = vm.condemned_bytes / sizeof(Obj*);
+  for (size_t i = 0; i < count; i++) {
+    set_mark(vm.condemned[i], true);
+  }
+  for (int i = 0; i < vm.revived_count; i++) {
+    set_mark(vm.revived[i], false);
+  }
+  vm.revived_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    Obj* object = vm.condemned[i];
+    if (is_marked(object) && object->type == OBJ_STRING) {
+      vm.strings.remove(static_cast<ObjString*>(object));
+    }
+  }
+  prune_remembered(true);
+  vm.sweep_condemned = true;
+  begin_sweep();
+}
+
+#endif
+
+static void begin_cycle() {
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm.bytes_allocated;
+  cycle_start_bytes = vm.bytes_allocated;
+#endif
+
+#ifdef GC_CONCURRENT_MARK
+  if (start_marker()) return;
 #endif
 
+  mark_roots();
+  vm.gc_phase = GC_MARK;
+}
+
+// Roots aren't covered by the write barrier, so they are marked again and 
+// traced in one go before anything is freed.
+static void finish_mark() {
   mark_roots();
   trace_references();
   vm.strings.remove_white();
-  sweep();
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  prune_remembered(false);
+  clear_nursery_marks();
+  begin_sweep();
+}
+
+static std::vector<Page*> sweep_pages;
+static std::atomic<size_t> next_sweep_page;
+static std::atomic<size_t> swept_bytes;
+
+static void sweep_worker() {
+  size_t bytes = 0;
+  byte_count = &bytes;
+  for (size_t i; (i = next_sweep_page++) < sweep_pages.size();) {
+    sweep_page(sweep_pages[i]);
+  }
+  byte_count = &vm.bytes_allocated;
+  swept_bytes += bytes;
+}
+
+// Pages don't share anything while they are being swept, so they can be 
+// handed out to gc_threads threads. Filing them afterwards touches the size 
+// class lists, so that is left to this thread.
+static void sweep_parallel() {
+  for (SizeClass& cls : vm.size_classes) {
+    for (Page* page = cls.unswept; page != nullptr; page = page->next) {
+      sweep_pages.push_back(page);
+    }
+    cls.unswept = nullptr;
+  }
+  next_sweep_page = 0;
+  swept_bytes = 0;
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < vm.gc_threads; i++) {
+    threads.emplace_back(sweep_worker);
+  }
+  sweep_worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  vm.bytes_allocated += swept_bytes;
+  for (Page* page : sweep_pages) {
+    file_page(page);
+  }
+  sweep_pages.clear();
+}
+
+static void finish_sweep() {
+  trim_page_pool();
+
+#ifdef GC_COMPACT
+  request_compaction();
+#endif
+
+  vm.gc_phase = GC_IDLE;
+  vm.sweep_condemned = false;
+  take_reserve();
+  vm.next_gc = std::max(static_cast<size_t>(vm.bytes_allocated * vm.heap_grow_factor), vm.heap_min);
+  if (vm.heap_max != 0) vm.next_gc = std::min(vm.next_gc, vm.heap_max);
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf(
-    "   collected %zu bytes (from %zu to %zu) next at %zu\n", 
-    before - vm.bytes_allocated, before, vm.bytes_allocated,
-    vm.next_gc
+    "   heap went from %zu to %zu bytes, next at %zu\n", 
+    cycle_start_bytes, vm.bytes_allocated, vm.next_gc
   );
 #endif
 }
 
+// Sweeps pages until about budget objects have been looked at, or all of 
+// them if budget is negative.
+static void sweep(int budget) {
+  if (budget < 0 && vm.gc_threads > 1) sweep_parallel();
+  for (SizeClass& cls : vm.size_classes) {
+    while (cls.unswept != nullptr) {
+      if (budget == 0) return;
+      Page* page = cls.unswept;
+      cls.unswept = page->next;
+      if (budget > 0) budget = budget > page->live_count ? budget - page->live_count : 0;
+      sweep_page(page);
+      file_page(page);
+    }
+  }
+  finish_sweep();
+}
+
+// Does at most gc_step_work objects' worth of marking or sweeping, so a 
+// major collection is spread over many allocations.
+void gc_step() {
+  if (vm.gc_phase == GC_IDLE) begin_cycle();
+  switch (vm.gc_phase) {
+    case GC_MARK:
+      // With threads to spare, marking in one parallel pause beats many 
+      // small serial steps.
+      if (vm.gc_threads > 1) {
+        trace_references();
+      } else {
+        for (int work = vm.gc_step_work; work > 0 && vm.gray_count > 0; work--) {
+          blacken_object(vm.gray_stack[--vm.gray_count]);
+        }
+      }
+      if (vm.gray_count == 0) finish_mark();
+      break;
+    case GC_CONCURRENT:
+
+#ifdef GC_CONCURRENT_MARK
+      if (read_marker(false)) finish_concurrent_mark();
+#endif
+
+      break;
+    case GC_SWEEP:
+      sweep(vm.gc_threads > 1 ? -1 : vm.gc_step_work);
+      break;
+    case GC_IDLE:
+      break;
+  }
+}
+
+// Finishes the cycle in progress, or runs a whole one, without stopping.
+void collect_garbage() {
+  if (vm.gc_phase == GC_IDLE) begin_cycle();
+
+#ifdef GC_CONCURRENT_MARK
+  if (vm.gc_phase == GC_CONCURRENT) {
+    read_marker(true);
+    finish_concurrent_mark();
+  }
+#endif
+
+  if (vm.gc_phase == GC_MARK) {
+    trace_references();
+    finish_mark();
+  }
+  sweep(-1);
+}
+
 void free_objects() {
-  Obj* object = vm.objects;
-  while (object != nullptr) {
-    Obj* next = object->next;
-    free_object(object);
-    object = next;
+
+#ifdef GC_CONCURRENT_MARK
+  if (vm.gc_phase == GC_CONCURRENT) {
+    kill(vm.marker_pid, SIGKILL);
+    waitpid(vm.marker_pid, nullptr, 0);
+    close(vm.marker_fd);
+  }
+#endif
+
+  walk_pages(free_contents);
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass* cls = &vm.size_classes[i];
+    free_pages(cls->available);
+    free_pages(cls->full);
+    free_pages(cls->unswept);
+  }
+  for (Page* list : {vm.size_classes[LARGE_CLASS].full, vm.size_classes[LARGE_CLASS].unswept}) {
+    while (list != nullptr) {
+      Page* next = list->next;
+      free_large_page(list);
+      list = next;
+    }
   }
+  free_pages(vm.free_pages);
+  walk_nursery(free_contents);
+  free(vm.nursery);
+  free(vm.nursery_marks);
+  free(vm.remembered);
+  free(vm.condemned);
+  free(vm.revived);
   free(vm.gray_stack);
+  if (vm.memory_reserve != nullptr) resize_buffer(vm.memory_reserve, MEMORY_RESERVE_SIZE, 0);
 }
 
@@ -3,6 +3,7 @@
 
 #include "common.hpp"
 #include "object.hpp"
+#include "vm.hpp"
 
 #define ALLOCATE(type, count) static_cast<type*>(reallocate(NULL, 0, sizeof(type) * (count)))
 
@@ -15,10 +16,153 @@
 
 #define FREE_ARRAY(type, pointer, old_count) reallocate(pointer, sizeof(type) * (old_count), 0)
 
+#define NURSERY_SIZE (256 * 1024)
+
+// Old objects live in pages of this size, which are aligned to it. Cells go 
+// up to the biggest that fits two to a page, and anything bigger than 
+// MAX_CELL_SIZE gets a page of its own.
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define MAX_CELL_SIZE (((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / 2) & ~static_cast<size_t>(15))
+
+// Defaults for the heap sizing settings in the VM, which main.cpp lets the 
+// environment and command line override. A maximum of 0 means no limit.
+#define GC_HEAP_INITIAL (1024 * 1024)
+#define GC_HEAP_MIN (1024 * 1024)
+#define GC_HEAP_MAX 0
+#define GC_HEAP_GROW_FACTOR 2
+
+// Buffers and large objects at least this big are mapped on their own.
+#define LARGE_BUFFER_SIZE (256 * 1024)
+
+// Memory held back so that a failed system allocation can be retried and 
+// reported as an error instead of ending the process.
+#define MEMORY_RESERVE_SIZE (1024 * 1024)
+
+// How many empty pages are kept for reuse when a sweep finishes.
+#define PAGE_POOL_PAGES 16
+
+// The share of the old generation's pages, in percent, that compaction 
+// would have to free before it is worth doing.
+#define GC_COMPACT_FRAGMENTATION 25
+
+// How many objects one incremental step marks or sweeps by default.
+#define GC_STEP_WORK 256
+
+// How many threads a full trace or sweep uses by default.
+#define GC_THREADS 1
+#define GC_THREADS_MAX 64
+
+// How many gray objects a tracing thread's deque holds before it grows.
+#define GRAY_DEQUE_CAPACITY 256
+
+void init_heap();
+void* resize_buffer(void* pointer, size_t old_size, size_t new_size);
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void out_of_memory();
+void* allocate_object(size_t size);
+void remember(Obj* object);
 void mark_object(Obj* object);
 void mark_value(Value value);
+void rescan_object(Obj* object);
+void revive_string(ObjString* string);
+void gc_step();
 void collect_garbage();
+void collect_nursery();
 void free_objects();
 
+#define PAGE_BITMAP_WORDS (HEAP_PAGE_SIZE / 16 / 64)
+
+// A page holds cells of one size class, or a single large object. Bit i of 
+// allocated is set while cell i holds an object, and bit i of marked while 
+// the collector has it marked. Keeping the mark bits out of the objects 
+// means marking writes nothing but these bitmaps.
+struct Page {
+  Page* next;
+  int size_class;
+  int cell_size;
+  int cell_count;
+  int live_count;
+  int first_free_word;
+  // Set while compaction moves the page's objects out. Each one's next then 
+  // holds the address of its copy.
+  bool evacuated;
+  // Multiplying a cell's offset by this and shifting right by 32 gives its 
+  // index, without a division.
+  uint32_t cell_reciprocal;
+  uint64_t allocated[PAGE_BITMAP_WORDS];
+  uint64_t marked[PAGE_BITMAP_WORDS];
+};
+
+#define PAGE_HEADER_SIZE ((sizeof(Page) + 15) & ~static_cast<size_t>(15))
+
+static inline bool is_young(Obj* object) {
+  return static_cast<size_t>(reinterpret_cast<char*>(object) - vm.nursery) < NURSERY_SIZE;
+}
+
+static inline Page* page_of(Obj* object) {
+  return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(object) & ~static_cast<uintptr_t>(HEAP_PAGE_SIZE - 1));
+}
+
+static inline Obj* page_cell(Page* page, int index) {
+  return reinterpret_cast<Obj*>(reinterpret_cast<char*>(page) + PAGE_HEADER_SIZE + static_cast<size_t>(index) * page->cell_size);
+}
+
+static inline int cell_index(Page* page, Obj* object) {
+  uint64_t offset = reinterpret_cast<char*>(object) - reinterpret_cast<char*>(page) - PAGE_HEADER_SIZE;
+  return static_cast<int>((offset * page->cell_reciprocal) >> 32);
+}
+
+// Young objects are marked in vm.nursery_marks, one bit per 8 bytes.
+static inline uint64_t* mark_word(Obj* object, uint64_t* bit) {
+  size_t index;
+  uint64_t* marks;
+  if (is_young(object)) {
+    index = static_cast<size_t>(reinterpret_cast<char*>(object) - vm.nursery) / 8;
+    marks = vm.nursery_marks;
+  } else {
+    Page* page = page_of(object);
+    index = cell_index(page, object);
+    marks = page->marked;
+  }
+  *bit = UINT64_C(1) << (index % 64);
+  return &marks[index / 64];
+}
+
+static inline bool is_marked(Obj* object) {
+  uint64_t bit;
+  return (*mark_word(object, &bit) & bit) != 0;
+}
+
+static inline void set_mark(Obj* object, bool marked) {
+  uint64_t bit;
+  uint64_t* word = mark_word(object, &bit);
+  *word = marked ? *word | bit : *word & ~bit;
+}
+
+// An old object that is handed a pointer into the nursery is remembered, so 
+// the next minor collection can update that pointer when it moves the target.
+// While marking is in progress, a value stored into an object that was 
+// already marked gets marked too, so it can't be missed.
+static inline void write_barrier(Obj* owner, Value value) {
+  if (!IS_OBJ(value)) return;
+  if (vm.gc_phase == GC_MARK && is_marked(owner)) mark_object(AS_OBJ(value));
+  if (is_young(AS_OBJ(value)) && !owner->is_remembered && !is_young(owner)) {
+    remember(owner);
+  }
+}
+
+// The marker process works on a snapshot, so a string it found dead may have 
+// been handed out again by the intern table since then.
+static inline void intern_barrier(ObjString* string) {
+  if (vm.gc_phase == GC_CONCURRENT && !is_young(string)) revive_string(string);
+}
+
+// For stores the caller doesn't look at one by one, like bulk copies.
+static inline void write_barrier_all(Obj* owner) {
+  if (vm.gc_phase == GC_MARK && is_marked(owner)) rescan_object(owner);
+  if (vm.nursery_top != vm.nursery && !owner->is_remembered && !is_young(owner)) {
+    remember(owner);
+  }
+}
+
 #endif
@@ -1,6 +1,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "native.hpp"
 #include "object.hpp"
 #include "vm.hpp"
@@ -48,15 +49,14 @@ Value string_native(int arg_count, Value* args) {
   Value value = args[0];
   if (IS_NUMBER(value)) {
     double n = AS_NUMBER(value);
-    char* buffer = static_cast<char*>(malloc(30 * sizeof(char)));
+    char buffer[30];
     size_t length = snprintf(buffer, sizeof(buffer), "%g", n);
-    if (length > sizeof(buffer)) {
-      free(buffer);
+    if (length >= sizeof(buffer)) {
       vm.runtime_error("Buffer too small to store the string.");
 		  vm.had_native_error = true;
       return NIL_VAL;
     }
-    return OBJ_VAL(take_string(buffer, length));
+    return OBJ_VAL(copy_string(buffer, length));
   } else if (IS_STRING(value)) {
     return value;
   } else if (IS_BOOL(value)) {
@@ -130,16 +130,58 @@ Value input_native(int arg_count, Value* val) {
   char* buffer = nullptr;
   size_t length = 0;
   ssize_t characters_read = getline(&buffer, &length, stdin);
-  if (characters_read == -1) return NIL_VAL;
-  for (int i = length - 1; i >= 0; i--) {
-    if (buffer[i] == '\n') {
-      buffer[i] = '\0';
-      break;
-    }
+  if (characters_read == -1) {
+    free(buffer);
+    return NIL_VAL;
   }
-  return OBJ_VAL(take_string(buffer, length));
+  if (characters_read > 0 && buffer[characters_read - 1] == '\n') characters_read--;
+  Value result = OBJ_VAL(copy_string(buffer, characters_read));
+  free(buffer);
+  return result;
 }
 
 Value clock_native(int arg_count, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
+
+// Builds a Range the way list literals build a List, filling in its bounds 
+// without calling a constructor, so it can take a variable argument count.
+Value range_native(int arg_count, Value* args) {
+  if (arg_count < 1 || arg_count > 3) {
+    vm.runtime_error("Expected 1 to 3 arguments but got %d.", arg_count);
+    vm.had_native_error = true;
+    return NIL_VAL;
+  }
+  for (int i = 0; i < arg_count; i++) {
+    if (!IS_NUMBER(args[i])) {
+      vm.runtime_error("Range arguments must be numbers.");
+      vm.had_native_error = true;
+      return NIL_VAL;
+    }
+  }
+  Value bounds[3] = {INT_VAL(0), args[0], INT_VAL(1)};
+  if (arg_count > 1) {
+    bounds[0] = args[0];
+    bounds[1] = args[1];
+  }
+  if (arg_count > 2) bounds[2] = args[2];
+  if (AS_NUMBER(bounds[2]) == 0) {
+    vm.runtime_error("Range step can't be zero.");
+    vm.had_native_error = true;
+    return NIL_VAL;
+  }
+
+  Value klass;
+  if (!vm.globals.get(copy_string("Range", 5), &klass) || !IS_CLASS(klass)) {
+    vm.runtime_error("Undefined class 'Range'.");
+    vm.had_native_error = true;
+    return NIL_VAL;
+  }
+  vm.push(OBJ_VAL(new (AS_CLASS(klass)) ObjInstance(AS_CLASS(klass))));
+  const char* fields[3] = {"_from", "_to", "_step"};
+  for (int i = 0; i < 3; i++) {
+    ObjString* name = copy_string(fields[i], static_cast<int>(strlen(fields[i])));
+    AS_INSTANCE(vm.peek(0))->set_field(name, bounds[i]);
+  }
+  return vm.pop();
+}
@@ -10,5 +10,6 @@ Value print_native(int arg_count, Value* args);
 Value println_native(int arg_count, Value* args);
 Value input_native(int arg_count, Value* val);
 Value clock_native(int arg_count, Value* args);
+Value range_native(int arg_count, Value* args);
 
 #endif
\ No newline at end of file
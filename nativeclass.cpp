@@ -14,7 +14,7 @@ Value native_instance_call(ObjNativeInstance* object, ObjString* name, int arg_c
 ObjNativeList::ObjNativeList() : ObjNativeInstance(NATIVE_LIST) {}
 
 void* ObjNativeList::operator new(size_t size) {
-	return reallocate(nullptr, 0, size);
+	return allocate_object(size);
 }
 
 Value ObjNativeList::call(ObjString* name, int arg_count, Value* args) {
@@ -79,6 +79,7 @@ name_error:
 
 void ObjNativeList::push(Value value) {
 	list.write(value);
+	write_barrier(this, value);
 }
 
 Value ObjNativeList::pop() {
@@ -91,13 +92,14 @@ void ObjNativeList::set(Value idx, Value value) {
 		vm.had_native_error = true;
 		return;
 	}
-	int i = static_cast<int>(AS_NUMBER(idx));
+	int i = IS_INT(idx) ? AS_INT(idx) : static_cast<int>(AS_NUMBER(idx));
 	if (i < 0 || i >= list.count) {
 		vm.runtime_error("Index out of bounds.");
 		vm.had_native_error = true;
 		return;
 	}
 	list.values[i] = value;
+	write_barrier(this, value);
 }
 
 Value ObjNativeList::get(Value idx) {
@@ -106,7 +108,7 @@ Value ObjNativeList::get(Value idx) {
 		vm.had_native_error = true;
 		return NIL_VAL;
 	}
-	int i = static_cast<int>(AS_NUMBER(idx));
+	int i = IS_INT(idx) ? AS_INT(idx) : static_cast<int>(AS_NUMBER(idx));
 	if (i < 0 || i >= list.count) {
 		vm.runtime_error("Index out of bounds.");
 		vm.had_native_error = true;
@@ -118,7 +120,7 @@ Value ObjNativeList::get(Value idx) {
 ObjNativeMap::ObjNativeMap() : ObjNativeInstance(NATIVE_MAP) {}
 
 void* ObjNativeMap::operator new(size_t size) {
-	return reallocate(nullptr, 0, size);
+	return allocate_object(size);
 }
 
 Value ObjNativeMap::call(ObjString* name, int arg_count, Value* args) {
@@ -200,6 +202,8 @@ void ObjNativeMap::set(Value key, Value value) {
 		vm.had_native_error = true;
 	}
 	map.set(key, value);
+	write_barrier(this, key);
+	write_barrier(this, value);
 }
 
 Value ObjNativeMap::get(Value key) {
@@ -7,65 +7,102 @@
 #include "nativeclass.hpp"
 #include "vm.hpp"
 
-Obj::Obj(ObjType type) : type(type), is_marked(false) {
-  next = vm.objects;
-  vm.objects = this;
+Obj::Obj(ObjType type) : type(type), is_remembered(false), next(nullptr) {
+  if (is_young(this)) return;
+  // Allocated old because the nursery was full or it was too big, so its 
+  // constructor may already be storing pointers to young objects.
+  write_barrier_all(this);
 }
 
-ObjFunction::ObjFunction() : Obj(OBJ_FUNCTION), arity(0), upvalue_count(0), name(nullptr) {}
+ObjFunction::ObjFunction() : Obj(OBJ_FUNCTION), arity(0), upvalue_count(0), capture_count(0), max_locals(0), name(nullptr) {}
 
 void* ObjFunction::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+  return allocate_object(size);
 }
 
 ObjNative::ObjNative(NativeFn function) : Obj(OBJ_NATIVE), function(function) {}
 
 void* ObjNative::operator new(size_t size) {
-  return reallocate(nullptr, 0, size); 
+  return allocate_object(size); 
 }
 
-ObjString::ObjString(char* chars, int length, uint32_t hash) 
-  : Obj(OBJ_STRING), length(length), chars(chars), hash(hash) {
-
-  vm.push(OBJ_VAL(this));
-  vm.strings.set(this, NIL_VAL);
-  vm.pop();
+ObjString::ObjString(int length) 
+  : Obj(OBJ_STRING), length(length), chars(reinterpret_cast<char*>(this + 1)), hash(0) {
+  chars[length] = '\0';
 }
 
-void* ObjString::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+void* ObjString::operator new(size_t size, int length) {
+  return allocate_object(string_size(length));
 }
 
 ObjUpvalue::ObjUpvalue(Value* slot) : Obj(OBJ_UPVALUE), location(slot), closed(NIL_VAL), next(nullptr) {} 
 
 void* ObjUpvalue::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+  return allocate_object(size);
 }
 
-ObjClosure::ObjClosure(ObjFunction* function, ObjUpvalue** upvalues) 
-  : Obj(OBJ_CLOSURE), function(function), upvalues(upvalues), upvalue_count(function->upvalue_count) {}
+ObjClosure::ObjClosure(ObjFunction* function) 
+  : Obj(OBJ_CLOSURE), function(function), upvalue_count(function->upvalue_count), 
+    capture_count(function->capture_count) {
+
+  captures = reinterpret_cast<Value*>(this + 1);
+  upvalues = reinterpret_cast<ObjUpvalue**>(captures + capture_count);
+  for (int i = 0; i < capture_count; i++) {
+    captures[i] = NIL_VAL;
+  }
+  for (int i = 0; i < upvalue_count; i++) {
+    upvalues[i] = nullptr;
+  }
+}
 
-void* ObjClosure::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+void* ObjClosure::operator new(size_t size, ObjFunction* function) {
+  return allocate_object(closure_size(function->upvalue_count, function->capture_count));
 }
 
-ObjClass::ObjClass(ObjString* name) : Obj(OBJ_CLASS), name(name) {}
+ObjClass::ObjClass(ObjString* name) : Obj(OBJ_CLASS), name(name), field_count(0) {}
 
 void* ObjClass::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+  return allocate_object(size);
 }
 
-ObjInstance::ObjInstance(ObjClass* klass) : Obj(OBJ_INSTANCE), klass(klass) {}
+ObjInstance::ObjInstance(ObjClass* klass) 
+  : Obj(OBJ_INSTANCE), klass(klass), field_count(klass->field_count) {
+
+  field_values = reinterpret_cast<Value*>(this + 1);
+  for (int i = 0; i < field_count; i++) {
+    field_values[i] = NIL_VAL;
+  }
+}
+
+void* ObjInstance::operator new(size_t size, ObjClass* klass) {
+  return allocate_object(instance_size(klass->field_count));
+}
+
+bool ObjInstance::get_field(ObjString* name, Value* value) {
+  Value slot;
+  if (field_count > 0 && klass->field_slots.get(name, &slot)) {
+    *value = field_values[static_cast<int>(AS_NUMBER(slot))];
+    return true;
+  }
+  return fields.get(name, value);
+}
 
-void* ObjInstance::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+void ObjInstance::set_field(ObjString* name, Value value) {
+  Value slot;
+  if (field_count > 0 && klass->field_slots.get(name, &slot)) {
+    field_values[static_cast<int>(AS_NUMBER(slot))] = value;
+  } else {
+    fields.set(name, value);
+  }
+  write_barrier(this, OBJ_VAL(name));
+  write_barrier(this, value);
 }
 
 ObjBoundMethod::ObjBoundMethod(Value receiver, ObjClosure* method) 
   : Obj(OBJ_BOUND_METHOD), receiver(receiver), method(method) {}
 
 void* ObjBoundMethod::operator new(size_t size) {
-  return reallocate(nullptr, 0, size);
+  return allocate_object(size);
 }
 
 ObjNativeInstance::ObjNativeInstance(NativeType native_type) : Obj(OBJ_NATIVE_INSTANCE), native_type(native_type) {}
@@ -79,33 +116,42 @@ static uint32_t hash_string(const char* key, int length) {
   return hash;
 }
 
-ObjString* take_string(char* chars, int length) {
-  uint32_t hash = hash_string(chars, length);
-  ObjString* interned = vm.strings.find_string(chars, length, hash);
+static ObjString* add_string(ObjString* string) {
+  vm.push(OBJ_VAL(string));
+  vm.strings.set(string, NIL_VAL);
+  vm.pop();
+  return string;
+}
+
+// The characters follow the object, so a string is a single allocation.
+ObjString* allocate_string(int length) {
+  return new (length) ObjString(length);
+}
+
+// For strings built in place by allocate_string. If an equal string is 
+// already interned, the new one is left for the collector.
+ObjString* intern_string(ObjString* string) {
+  string->hash = hash_string(string->chars, string->length);
+  ObjString* interned = vm.strings.find_string(string->chars, string->length, string->hash);
   if (interned != nullptr) {
-    FREE_ARRAY(char, chars, length + 1);
+    intern_barrier(interned);
     return interned;
   }
-  return new ObjString(chars, length, hash);
+  return add_string(string);
 }
 
 ObjString* copy_string(const char* chars, int length) {
   uint32_t hash = hash_string(chars, length);
   ObjString* interned = vm.strings.find_string(chars, length, hash);
-  if (interned != nullptr) return interned;
-  
-  char* heap_chars = ALLOCATE(char, length + 1);
-  memcpy(heap_chars, chars, length);
-  heap_chars[length] = '\0';
-  return new ObjString(heap_chars, length, hash);
-}
-
-ObjUpvalue** make_upvalue_array(int count) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, count);
-  for (int i = 0; i < count; i++) {
-    upvalues[i] = nullptr;
+  if (interned != nullptr) {
+    intern_barrier(interned);
+    return interned;
   }
-  return upvalues;
+  
+  ObjString* string = allocate_string(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  return add_string(string);
 }
 
 static void print_function(ObjFunction* function) {
@@ -39,9 +39,12 @@ enum ObjType {
   OBJ_UPVALUE
 };
 
+// Objects start out in the nursery, where next is null until a minor 
+// collection copies them out and leaves the address of the copy there. Old 
+// objects live in the pages of the old generation and don't use next.
 struct Obj {
   ObjType type;
-  bool is_marked;
+  bool is_remembered;
   Obj* next;
 
   Obj(ObjType type);
@@ -50,6 +53,8 @@ struct Obj {
 struct ObjFunction : public Obj {
   int arity;
   int upvalue_count;
+  int capture_count;
+  int max_locals;
   Chunk chunk;
   ObjString* name;
 
@@ -71,8 +76,8 @@ struct ObjString : public Obj {
   char* chars;
   uint32_t hash;
 
-  ObjString(char* chars, int length, uint32_t hash);
-  void* operator new(size_t size);
+  ObjString(int length);
+  void* operator new(size_t size, int length);
 };
 
 struct ObjUpvalue : public Obj {
@@ -88,25 +93,35 @@ struct ObjClosure : public Obj {
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalue_count;
+  Value* captures;
+  int capture_count;
 
-  ObjClosure(ObjFunction* function, ObjUpvalue** upvalues);
-  void* operator new(size_t size);
+  ObjClosure(ObjFunction* function);
+  void* operator new(size_t size, ObjFunction* function);
 };
 
 struct ObjClass : public Obj {
   ObjString* name;
   Table methods;
+  Table field_slots;
+  int field_count;
 
   ObjClass(ObjString* name);
   void* operator new(size_t size);
 };
 
+// Declared fields live in a flat array after the instance, in the slots 
+// given by the class's field_slots. Anything else goes in the fields table.
 struct ObjInstance : public Obj {
   ObjClass* klass;
   Table fields; 
+  Value* field_values;
+  int field_count;
 
   ObjInstance(ObjClass* klass);
-  void* operator new(size_t size);
+  void* operator new(size_t size, ObjClass* klass);
+  bool get_field(ObjString* name, Value* value);
+  void set_field(ObjString* name, Value value);
 };
 
 struct ObjBoundMethod : public Obj {
@@ -128,11 +143,23 @@ struct ObjNativeInstance : public Obj {
   ObjNativeInstance(NativeType native_type);
 };
 
-ObjString* take_string(char* chars, int length);
+ObjString* allocate_string(int length);
+ObjString* intern_string(ObjString* string);
 ObjString* copy_string(const char* chars, int length);
-ObjUpvalue** make_upvalue_array(int count);
 void print_object(Value value);
 
+static inline size_t closure_size(int upvalue_count, int capture_count) {
+  return sizeof(ObjClosure) + sizeof(Value) * capture_count + sizeof(ObjUpvalue*) * upvalue_count;
+}
+
+static inline size_t string_size(int length) {
+  return sizeof(ObjString) + length + 1;
+}
+
+static inline size_t instance_size(int field_count) {
+  return sizeof(ObjInstance) + sizeof(Value) * field_count;
+}
+
 static inline bool is_obj_type(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
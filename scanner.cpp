@@ -4,18 +4,21 @@
 #include "common.hpp"
 #include "scanner.hpp"
 
-struct Scanner {
-  const char* start;
-  const char* curr;
-  int line;
-};
-
 Scanner scanner;
 
 void init_scanner(const char* source) {
   scanner.start = source;
   scanner.curr = source;
   scanner.line = 1;
+  scanner.interpolation_depth = 0;
+}
+
+Scanner save_scanner() {
+  return scanner;
+}
+
+void restore_scanner(Scanner state) {
+  scanner = state;
 }
 
 static bool is_alpha(char c) {
@@ -102,7 +105,16 @@ static TokenType check_keyword(int start, int length, const char* rest, TokenTyp
 static TokenType identifier_type() {
   switch (scanner.start[0]) {
     case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
+    case 'c':
+      if (scanner.curr - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'a': return check_keyword(2, 2, "se", TOKEN_CASE);
+          case 'l': return check_keyword(2, 3, "ass", TOKEN_CLASS);
+          case 'o': return check_keyword(2, 3, "nst", TOKEN_CONST);
+        }
+      }
+      break;
+    case 'd': return check_keyword(1, 6, "efault", TOKEN_DEFAULT);
     case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
     case 'f':
       if (scanner.curr - scanner.start > 1) {
@@ -113,12 +125,26 @@ static TokenType identifier_type() {
         }
       }
       break;
-    case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
+    case 'i':
+      if (scanner.curr - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'f': return check_keyword(2, 0, "", TOKEN_IF);
+          case 'n': return check_keyword(2, 0, "", TOKEN_IN);
+        }
+      }
+      break;
     case 'l': return check_keyword(1, 2, "et", TOKEN_LET);
     case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
     case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
     case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
+    case 's':
+      if (scanner.curr - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'u': return check_keyword(2, 3, "per", TOKEN_SUPER);
+          case 'w': return check_keyword(2, 4, "itch", TOKEN_SWITCH);
+        }
+      }
+      break;
     case 't':
       if (scanner.curr - scanner.start > 1) {
         switch (scanner.start[1]) {
@@ -148,6 +174,15 @@ static Token number() {
 
 static Token string() {
   while (peek() != '"' && peek() != '\'' && !is_at_end()) {
+    if (peek() == '$' && peek_next() == '{') {
+      if (scanner.interpolation_depth == MAX_INTERPOLATION_DEPTH) {
+        return error_token("Interpolation nested too deeply.");
+      }
+      advance();
+      advance();
+      scanner.braces[scanner.interpolation_depth++] = 0;
+      return make_token(TOKEN_INTERPOLATION);
+    }
     if (peek() == '\n') scanner.line++;
     advance();
   }
@@ -166,8 +201,17 @@ Token scan_token() {
   switch (c) {
     case '(': return make_token(TOKEN_LEFT_PAREN);
     case ')': return make_token(TOKEN_RIGHT_PAREN);
-    case '{': return make_token(TOKEN_LEFT_BRACE);
-    case '}': return make_token(TOKEN_RIGHT_BRACE);
+    case '{':
+      if (scanner.interpolation_depth > 0) scanner.braces[scanner.interpolation_depth - 1]++;
+      return make_token(TOKEN_LEFT_BRACE);
+    case '}':
+      if (scanner.interpolation_depth > 0) {
+        if (scanner.braces[scanner.interpolation_depth - 1]-- == 0) {
+          scanner.interpolation_depth--;
+          return string();
+        }
+      }
+      return make_token(TOKEN_RIGHT_BRACE);
     case '[': return make_token(TOKEN_LEFT_BRACKET);
     case ']': return make_token(TOKEN_RIGHT_BRACKET);
     case ';': return make_token(TOKEN_SEMICOLON);
@@ -180,8 +224,12 @@ Token scan_token() {
 		case '*': return make_token(match('=') ? TOKEN_STAR_EQUAL : (match('*') ? (match('=') ? TOKEN_STAR_STAR_EQUAL : TOKEN_STAR_STAR) : TOKEN_STAR));
     case '!': return make_token( match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-    case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-    case '>': return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : (match('<') ? (match('=') ? TOKEN_LESS_LESS_EQUAL : TOKEN_LESS_LESS) : TOKEN_LESS));
+    case '>': return make_token(match('=') ? TOKEN_GREATER_EQUAL : (match('>') ? (match('=') ? TOKEN_GREATER_GREATER_EQUAL : TOKEN_GREATER_GREATER) : TOKEN_GREATER));
+    case '&': return make_token(match('=') ? TOKEN_AMPERSAND_EQUAL : TOKEN_AMPERSAND);
+    case '|': return make_token(match('=') ? TOKEN_PIPE_EQUAL : TOKEN_PIPE);
+    case '^': return make_token(match('=') ? TOKEN_CARET_EQUAL : TOKEN_CARET);
+    case '~': return make_token(TOKEN_TILDE);
     case '"': return string();
     case '\'': return string();
   }
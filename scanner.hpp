@@ -9,18 +9,22 @@ typedef enum {
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS,
   TOKEN_STAR_STAR, TOKEN_SLASH_SLASH,
+  TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET, TOKEN_TILDE,
+  TOKEN_LESS_LESS, TOKEN_GREATER_GREATER,
   TOKEN_BANG, TOKEN_BANG_EQUAL,
   TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
   TOKEN_GREATER, TOKEN_GREATER_EQUAL,
   TOKEN_LESS, TOKEN_LESS_EQUAL,
-  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-  TOKEN_FOR, TOKEN_FN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-  TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, TOKEN_COLON,
-  TOKEN_TRUE, TOKEN_LET, TOKEN_WHILE,
+  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_INTERPOLATION, TOKEN_NUMBER,
+  TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE,
+  TOKEN_FOR, TOKEN_FN, TOKEN_IF, TOKEN_IN, TOKEN_NIL, TOKEN_OR,
+  TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS, TOKEN_COLON,
+  TOKEN_TRUE, TOKEN_LET, TOKEN_CONST, TOKEN_WHILE,
   TOKEN_PLUS_EQUAL, TOKEN_MINUS_EQUAL,
 	TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL,
 	TOKEN_STAR_STAR_EQUAL, TOKEN_SLASH_SLASH_EQUAL,
+	TOKEN_AMPERSAND_EQUAL, TOKEN_PIPE_EQUAL, TOKEN_CARET_EQUAL,
+	TOKEN_LESS_LESS_EQUAL, TOKEN_GREATER_GREATER_EQUAL,
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
 
@@ -31,7 +35,21 @@ struct Token {
   int line;
 };
 
+#define MAX_INTERPOLATION_DEPTH 8
+
+// braces counts the unmatched '{' inside each open ${...}, so the '}' that 
+// closes the interpolation can be told apart from one that closes a map.
+struct Scanner {
+  const char* start;
+  const char* curr;
+  int line;
+  int interpolation_depth;
+  int braces[MAX_INTERPOLATION_DEPTH];
+};
+
 void init_scanner(const char* source);
+Scanner save_scanner();
+void restore_scanner(Scanner state);
 Token scan_token();
 
 #endif
@@ -65,7 +65,7 @@ ObjString* Table::find_string(const char* chars, int length, uint32_t hash) {
 void Table::remove_white() {
   for (int i = 0; i < capacity; i++) {
     TableEntry* entry = &entries[i];
-    if (entry->key != nullptr && !entry->key->is_marked) {
+    if (entry->key != nullptr && !is_marked(entry->key)) {
       remove(entry->key);
     }
   }
@@ -15,6 +15,12 @@ void ValueArray::write(Value value) {
   values[count++] = value;
 }
 
+void ValueArray::reserve(int new_capacity) {
+  if (capacity >= new_capacity) return;
+  values = GROW_ARRAY(Value, values, capacity, new_capacity);
+  capacity = new_capacity;
+}
+
 void ValueArray::clear() {
   FREE_ARRAY(Value, values, capacity);
   capacity = 0;
@@ -11,18 +11,25 @@ typedef struct ObjString ObjString;
 
 #define SIGN_BIT  ((uint64_t)0x8000000000000000)
 #define QNAN      ((uint64_t)0x7ffc000000000000)
+#define TAG_INT   ((uint64_t)0x0002000000000000)
 #define TAG_NIL   1 
 #define TAG_FALSE 2 
 #define TAG_TRUE  3 
 
 using Value = uint64_t;
 
+// Numbers that are exactly representable as an int32 (other than -0) are 
+// always stored as tagged integers, so equal numbers have equal bits and 
+// values_equal() can keep comparing raw values.
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value)       (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_INT(value)       static_cast<int32_t>(static_cast<uint32_t>(value))
 #define AS_NUMBER(value)    value_to_num(value)
 #define AS_OBJ(value)       reinterpret_cast<Obj*>((value) & ~(SIGN_BIT | QNAN))
 
@@ -30,15 +37,32 @@ using Value = uint64_t;
 #define FALSE_VAL           static_cast<Value>(QNAN | TAG_FALSE)
 #define TRUE_VAL            static_cast<Value>(QNAN | TAG_TRUE)
 #define NIL_VAL             static_cast<Value>(QNAN | TAG_NIL)
+#define INT_VAL(i)          static_cast<Value>(QNAN | TAG_INT | static_cast<uint32_t>(i))
 #define NUMBER_VAL(num)     num_to_value(num)
 #define OBJ_VAL(obj)        static_cast<Value>(SIGN_BIT | QNAN | reinterpret_cast<uint64_t>(obj))
 
 static inline double value_to_num(Value value) {
+  if (IS_INT(value)) return AS_INT(value);
   return *reinterpret_cast<double*>(&value);
 }
 
 static inline Value num_to_value(double num) {
-  return *reinterpret_cast<Value*>(&num);
+  Value bits = *reinterpret_cast<Value*>(&num);
+  if (num >= INT32_MIN && num <= INT32_MAX) {
+    int32_t i = static_cast<int32_t>(num);
+    if (i == num && bits != SIGN_BIT) return INT_VAL(i);
+  }
+  return bits;
+}
+
+static inline Value num_to_value(int64_t num) {
+  if (num >= INT32_MIN && num <= INT32_MAX) return INT_VAL(num);
+  double d = static_cast<double>(num);
+  return *reinterpret_cast<Value*>(&d);
+}
+
+static inline Value num_to_value(int32_t num) {
+  return INT_VAL(num);
 }
 
 #else
@@ -61,16 +85,19 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_INT(value)     false
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
+#define AS_INT(value)     static_cast<int32_t>((value).as.number)
 #define AS_NUMBER(value)  ((value).as.number)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    NUMBER_VAL(value)
+#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = static_cast<double>(value)}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 #endif
@@ -82,6 +109,7 @@ struct ValueArray {
 
   ValueArray();
   void write(Value value);
+  void reserve(int new_capacity);
   void clear();
 };
 
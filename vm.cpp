@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "vm.hpp"
@@ -16,13 +17,53 @@ VM vm;
 
 VM::VM() {
   clear_stack();
-  objects = nullptr;
+  init_heap();
+  gc_phase = GC_IDLE;
+  gc_step_work = GC_STEP_WORK;
+  gc_threads = GC_THREADS;
+  sweep_condemned = false;
+  marker_pid = -1;
+  marker_fd = -1;
+  condemned_bytes = 0;
+  condemned_capacity = 0;
+  condemned = nullptr;
+  revived_count = 0;
+  revived_capacity = 0;
+  revived = nullptr;
   bytes_allocated = 0;
-  next_gc = 1024 * 1024;
+  next_gc = GC_HEAP_INITIAL;
+  heap_min = GC_HEAP_MIN;
+  heap_max = GC_HEAP_MAX;
+  heap_grow_factor = GC_HEAP_GROW_FACTOR;
+  heap_exhausted = false;
   gray_count = 0;
   gray_capacity = 0;
   gray_stack = nullptr;
+  // Nothing is running yet to report an error to, so failing here still 
+  // ends the process.
+  nursery = static_cast<char*>(malloc(NURSERY_SIZE));
+  if (nursery == nullptr) exit(1);
+  nursery_top = nursery;
+  nursery_marks = static_cast<uint64_t*>(calloc(NURSERY_SIZE / 8 / 64, sizeof(uint64_t)));
+  if (nursery_marks == nullptr) exit(1);
+  gc_request = false;
+  compact_request = false;
+  remembered_count = 0;
+  remembered_capacity = 0;
+  remembered = nullptr;
   had_native_error = false;
+  list_class = nullptr;
+  list_field = nullptr;
+  map_class = nullptr;
+  map_field = nullptr;
+  iter_string = nullptr;
+  next_string = nullptr;
+  list_class = copy_string("List", 4);
+  list_field = copy_string("_list", 5);
+  map_class = copy_string("Map", 3);
+  map_field = copy_string("_map", 4);
+  iter_string = copy_string("iter", 4);
+  next_string = copy_string("next", 4);
 
   define_native("number", number_native);
   define_native("string", string_native);
@@ -31,6 +72,7 @@ VM::VM() {
   define_native("println", println_native);
   define_native("input", input_native);
   define_native("clock", clock_native);
+  define_native("range", range_native);
   define_native("type", type_native);
   
   define_native("_List", native_list);
@@ -38,10 +80,11 @@ VM::VM() {
 }
 
 InterpretResult VM::interpret(const char* source) {
+  heap_exhausted = false;
   ObjFunction* function = compile(source);
   if (function == nullptr) return INTERPRET_COMPILE_ERROR;
   push(OBJ_VAL(function));
-  ObjClosure* closure = new ObjClosure(function, make_upvalue_array(function->upvalue_count));
+  ObjClosure* closure = new (function) ObjClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
@@ -83,7 +126,9 @@ void VM::runtime_error(const char* format, ...) {
   for (int i = frame_count - 1; i >= 0; i--) {
     CallFrame* frame = &frames[i];
     ObjFunction* function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
+    // A frame that was just called hasn't run an instruction yet.
+    size_t instruction = frame->ip - function->chunk.code;
+    if (instruction > 0) instruction--;
     fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
     if (function->name == nullptr) {
       fprintf(stderr, "script\n");
@@ -100,7 +145,7 @@ bool VM::call(ObjClosure* closure, int arg_count) {
     runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
     return false;
   }
-  if (frame_count == FRAMES_MAX) {
+  if (frame_count == FRAMES_MAX || stack_top + closure->function->max_locals > stack + STACK_MAX) {
     runtime_error("Stack overflow.");
     return false;
   }
@@ -121,7 +166,7 @@ bool VM::call_value(Value callee, int arg_count) {
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
-        stack_top[-arg_count - 1] = OBJ_VAL(new ObjInstance(klass));
+        stack_top[-arg_count - 1] = OBJ_VAL(new (klass) ObjInstance(klass));
         Value initializer;
         if (klass->methods.get(klass->name, &initializer)) {
           return call(AS_CLOSURE(initializer), arg_count);
@@ -175,7 +220,7 @@ bool VM::invoke(ObjString* name, int arg_count) {
   
   ObjInstance* instance = AS_INSTANCE(receiver);
   Value value;
-  if (instance->fields.get(name, &value)) {
+  if (instance->get_field(name, &value)) {
     stack_top[-arg_count - 1] = value;
     return call_value(value, arg_count);
   }
@@ -219,6 +264,7 @@ void VM::close_upvalues(Value* last) {
     ObjUpvalue* upvalue = open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    write_barrier(upvalue, upvalue->closed);
     open_upvalues = upvalue->next;
   }
 }
@@ -227,9 +273,20 @@ void VM::define_method(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   klass->methods.set(name, method);
+  write_barrier(klass, OBJ_VAL(name));
+  write_barrier(klass, method);
   pop();
 }
 
+void VM::define_field(ObjString* name) {
+  ObjClass* klass = AS_CLASS(peek(0));
+  Value unused;
+  if (!klass->field_slots.get(name, &unused)) {
+    klass->field_slots.set(name, NUMBER_VAL(klass->field_count++));
+    write_barrier(klass, OBJ_VAL(name));
+  }
+}
+
 void VM::define_native(const char* name, NativeFn function) {
   push(OBJ_VAL(copy_string(name, (int)strlen(name))));
   push(OBJ_VAL(new ObjNative(function)));
@@ -238,36 +295,294 @@ void VM::define_native(const char* name, NativeFn function) {
   pop();
 }
 
+// List and map literals fill the native storage directly and then wrap it 
+// the way the stl constructors do, without calling them.
+bool VM::wrap_literal(ObjString* class_name, ObjString* field_name) {
+  Value klass;
+  if (!globals.get(class_name, &klass) || !IS_CLASS(klass)) {
+    runtime_error("Undefined class '%s'.", class_name->chars);
+    return false;
+  }
+  push(OBJ_VAL(new (AS_CLASS(klass)) ObjInstance(AS_CLASS(klass))));
+  AS_INSTANCE(peek(0))->set_field(field_name, peek(1));
+  stack_top[-2] = stack_top[-1];
+  pop();
+  return true;
+}
+
+ObjNativeInstance* VM::literal_storage(Value literal, ObjString* field_name, NativeType type) {
+  Value storage;
+  if (
+    !IS_INSTANCE(literal) || !AS_INSTANCE(literal)->get_field(field_name, &storage) || 
+    !IS_NATIVE_INSTANCE(storage) || AS_NATIVE_INSTANCE(storage)->native_type != type
+  ) {
+    runtime_error("Literal storage is missing.");
+    return nullptr;
+  }
+  return AS_NATIVE_INSTANCE(storage);
+}
+
+static bool check_keys(Value* pairs, int count) {
+  for (int i = 0; i < count; i++) {
+    if (IS_NIL(pairs[2 * i])) {
+      vm.runtime_error("Key cannot be nil.");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool VM::build_list(int count) {
+  ObjNativeList* list = new ObjNativeList();
+  push(OBJ_VAL(list));
+  list->list.reserve(count);
+  if (count > 0) memcpy(list->list.values, stack_top - count - 1, sizeof(Value) * count);
+  list->list.count = count;
+  stack_top[-count - 1] = OBJ_VAL(list);
+  stack_top -= count;
+  return wrap_literal(list_class, list_field);
+}
+
+bool VM::extend_list(int count) {
+  ObjNativeInstance* storage = literal_storage(peek(count), list_field, NATIVE_LIST);
+  if (storage == nullptr) return false;
+  ValueArray* list = &static_cast<ObjNativeList*>(storage)->list;
+  list->reserve(list->count + count);
+  if (count > 0) memcpy(list->values + list->count, stack_top - count, sizeof(Value) * count);
+  list->count += count;
+  write_barrier_all(storage);
+  stack_top -= count;
+  return true;
+}
+
+bool VM::build_map(int count) {
+  if (!check_keys(stack_top - 2 * count, count)) return false;
+  ObjNativeMap* map = new ObjNativeMap();
+  push(OBJ_VAL(map));
+  map->map.reserve(count);
+  for (Value* pair = stack_top - 2 * count - 1; pair < stack_top - 1; pair += 2) {
+    map->map.set(pair[0], pair[1]);
+  }
+  stack_top[-2 * count - 1] = OBJ_VAL(map);
+  stack_top -= 2 * count;
+  return wrap_literal(map_class, map_field);
+}
+
+bool VM::extend_map(int count) {
+  ObjNativeInstance* storage = literal_storage(peek(2 * count), map_field, NATIVE_MAP);
+  if (storage == nullptr || !check_keys(stack_top - 2 * count, count)) return false;
+  Map* map = &static_cast<ObjNativeMap*>(storage)->map;
+  map->reserve(map->count + count);
+  for (Value* pair = stack_top - 2 * count; pair < stack_top; pair += 2) {
+    map->set(pair[0], pair[1]);
+  }
+  write_barrier_all(storage);
+  stack_top -= 2 * count;
+  return true;
+}
+
+// Returns the text string() gives for a value. Numbers are formatted into 
+// buffer, everything else points at existing characters.
+static const char* value_chars(Value value, char* buffer, int* length) {
+  const char* chars;
+  if (IS_STRING(value)) {
+    *length = AS_STRING(value)->length;
+    return AS_CSTRING(value);
+  } else if (IS_NUMBER(value)) {
+    *length = snprintf(buffer, 32, "%g", AS_NUMBER(value));
+    return buffer;
+  } else if (IS_BOOL(value)) {
+    chars = AS_BOOL(value) ? "true" : "false";
+  } else if (IS_NIL(value)) {
+    chars = "nil";
+  } else {
+    ObjString* name = nullptr;
+    chars = "<script>";
+    switch (OBJ_TYPE(value)) {
+      case OBJ_BOUND_METHOD: name = AS_BOUND_METHOD(value)->method->function->name; break;
+      case OBJ_CLASS: name = AS_CLASS(value)->name; break;
+      case OBJ_CLOSURE: name = AS_CLOSURE(value)->function->name; break;
+      case OBJ_FUNCTION: name = AS_FUNCTION(value)->name; break;
+      case OBJ_INSTANCE: name = AS_INSTANCE(value)->klass->name; break;
+      case OBJ_NATIVE_INSTANCE: chars = "native instance"; break;
+      case OBJ_NATIVE: chars = "<native fn>"; break;
+      default: chars = "upvalue"; break;
+    }
+    if (name != nullptr) {
+      *length = name->length;
+      return name->chars;
+    }
+  }
+  *length = strlen(chars);
+  return chars;
+}
+
+// Joins the parts of an interpolated string with a single allocation.
+void VM::build_string(int count) {
+  char buffer[32];
+  int length = 0;
+  for (Value* part = stack_top - count; part < stack_top; part++) {
+    int part_length;
+    value_chars(*part, buffer, &part_length);
+    length += part_length;
+  }
+
+  ObjString* result = allocate_string(length);
+  char* dest = result->chars;
+  for (Value* part = stack_top - count; part < stack_top; part++) {
+    int part_length;
+    const char* part_chars = value_chars(*part, buffer, &part_length);
+    memcpy(dest, part_chars, part_length);
+    dest += part_length;
+  }
+
+  result = intern_string(result);
+  stack_top -= count;
+  push(OBJ_VAL(result));
+}
+
+// Lists, maps and sets are walked in place with an int cursor. Any other 
+// instance needs an iter() method, whose result answers next() until nil.
+bool VM::iter_init(int var_count) {
+  Value iterable = peek(0);
+  if (IS_INSTANCE(iterable)) {
+    ObjInstance* instance = AS_INSTANCE(iterable);
+    Value value;
+    if (instance->klass->methods.get(iter_string, &value)) {
+      if (var_count != 1) {
+        runtime_error("Only one loop variable can take values from 'next'.");
+        return false;
+      }
+      push(iterable);
+      return call(AS_CLOSURE(value), 0);
+    }
+    if (instance->get_field(list_field, &value) || instance->get_field(map_field, &value)) {
+      iterable = value;
+    }
+  }
+  if (!IS_NATIVE_INSTANCE(iterable)) {
+    runtime_error("Can only iterate over lists, maps, sets and instances with an 'iter' method.");
+    return false;
+  }
+  stack_top[-1] = iterable;
+  push(INT_VAL(0));
+  return true;
+}
+
+// Copies the element under the cursor into the loop variables and moves the
+// cursor past it. Lists give the index and element to two variables, maps 
+// the key and value.
+static bool iter_native(Value* base, int var_count) {
+  ObjNativeInstance* storage = AS_NATIVE_INSTANCE(base[0]);
+  int cursor = AS_INT(base[1]);
+  if (storage->native_type == NATIVE_LIST) {
+    ValueArray* list = &static_cast<ObjNativeList*>(storage)->list;
+    if (cursor >= list->count) return false;
+    if (var_count == 1) {
+      base[2] = list->values[cursor];
+    } else {
+      base[2] = INT_VAL(cursor);
+      base[3] = list->values[cursor];
+    }
+  } else {
+    Map* map = &static_cast<ObjNativeMap*>(storage)->map;
+    while (cursor < map->capacity && map->entries[cursor].key == NIL_VAL) cursor++;
+    if (cursor >= map->capacity) return false;
+    base[2] = map->entries[cursor].key;
+    if (var_count == 2) base[3] = map->entries[cursor].value;
+  }
+  base[1] = INT_VAL(cursor + 1);
+  return true;
+}
+
 void VM::concatenate() {
   ObjString* b = AS_STRING(peek(0));
   ObjString* a = AS_STRING(peek(1));
 
   int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = take_string(chars, length);
+  ObjString* result = allocate_string(length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+  result = intern_string(result);
 
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
+// Bitwise operators work on the integers a double holds exactly.
+static bool as_integer(Value value, int64_t* out) {
+  if (IS_INT(value)) {
+    *out = AS_INT(value);
+    return true;
+  }
+  if (!IS_NUMBER(value)) return false;
+  double num = AS_NUMBER(value);
+  if (num != floor(num) || num > MAX_SAFE_INTEGER || num < -MAX_SAFE_INTEGER) return false;
+  *out = static_cast<int64_t>(num);
+  return true;
+}
+
 InterpretResult VM::run() {
   CallFrame* frame = &frames[frame_count - 1];
+  bool wide = false;
 
 #define READ_BYTE() (*frame->ip++)
 
 #define READ_SHORT() (frame->ip += 2, static_cast<uint16_t>((frame->ip[-2] << 8) | frame->ip[-1]))
 
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_LONG() (frame->ip += 3, static_cast<uint32_t>((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+
+#define READ_INDEX() (wide ? (wide = false, READ_LONG()) : READ_BYTE())
+
+#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_INDEX()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+// Calls, returns and backward jumps are the points where no C++ code holds
+// object pointers, so objects can be moved there.
+#define SAFEPOINT() \
+    do { \
+      if (gc_request) { \
+        collect_nursery(); \
+        if (heap_exhausted) { \
+          heap_exhausted = false; \
+          if (memory_reserve == nullptr || heap_max == 0) { \
+            runtime_error("Out of memory."); \
+          } else { \
+            runtime_error("Out of memory: the heap limit is %zu bytes.", heap_max); \
+          } \
+          return INTERPRET_RUNTIME_ERROR; \
+        } \
+      } \
+    } while (false)
+
+#define BITWISE_OP(op) \
+    do { \
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+        int32_t b = AS_INT(pop()); \
+        int32_t a = AS_INT(pop()); \
+        push(INT_VAL(a op b)); \
+        break; \
+      } \
+      int64_t a, b; \
+      if (!as_integer(peek(1), &a) || !as_integer(peek(0), &b)) { \
+        runtime_error("Operands must be integers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      pop(); \
+      pop(); \
+      push(NUMBER_VAL(a op b)); \
+    } while (false)
+
 #define BINARY_OP(value_type, op) \
     do { \
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+        int64_t b = AS_INT(pop()); \
+        int64_t a = AS_INT(pop()); \
+        push(value_type(a op b)); \
+        break; \
+      } \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
         runtime_error("Operands must be numbers."); \
         return INTERPRET_RUNTIME_ERROR; \
@@ -287,7 +602,9 @@ InterpretResult VM::run() {
       printf(" ]");
     }
     printf("\n");
-    disassemble_instruction(&frame->closure->function->chunk, static_cast<int>(frame->ip - frame->closure->function->chunk.code));
+    if (!wide) {
+      disassemble_instruction(&frame->closure->function->chunk, static_cast<int>(frame->ip - frame->closure->function->chunk.code));
+    }
 #endif
 
     uint8_t instruction;
@@ -297,6 +614,11 @@ InterpretResult VM::run() {
         push(constant);
         break;
       }
+      case OP_CONSTANT_LONG: {
+        Value constant = frame->closure->function->chunk.constants.values[READ_LONG()];
+        push(constant);
+        break;
+      }
       case OP_NIL: 
         push(NIL_VAL); 
         break;
@@ -310,12 +632,12 @@ InterpretResult VM::run() {
         pop(); 
         break;
       case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
+        uint16_t slot = READ_INDEX();
         push(frame->slots[slot]);
         break;
       }
       case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
+        uint16_t slot = READ_INDEX();
         frame->slots[slot] = peek(0);
         break;
       }
@@ -345,13 +667,19 @@ InterpretResult VM::run() {
         break;
       }
       case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
+        uint16_t slot = READ_INDEX();
         push(*frame->closure->upvalues[slot]->location);
         break;
       }
       case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+        ObjUpvalue* upvalue = frame->closure->upvalues[READ_INDEX()];
+        *upvalue->location = peek(0);
+        write_barrier(upvalue, peek(0));
+        break;
+      }
+      case OP_GET_CAPTURE: {
+        uint16_t slot = READ_INDEX();
+        push(frame->closure->captures[slot]);
         break;
       }
       case OP_GET_PROPERTY: {
@@ -362,7 +690,7 @@ InterpretResult VM::run() {
         ObjInstance* instance = AS_INSTANCE(peek(0));
         ObjString* name = READ_STRING();
         Value value;
-        if (instance->fields.get(name, &value)) {
+        if (instance->get_field(name, &value)) {
           pop(); 
           push(value);
           break;
@@ -378,12 +706,23 @@ InterpretResult VM::run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         ObjInstance* instance = AS_INSTANCE(peek(1));
-        instance->fields.set(READ_STRING(), peek(0));
+        instance->set_field(READ_STRING(), peek(0));
         Value value = pop();
         pop();
         push(value);
         break;
       }
+      case OP_GET_FIELD: {
+        ObjInstance* instance = AS_INSTANCE(frame->slots[0]);
+        push(instance->field_values[READ_INDEX()]);
+        break;
+      }
+      case OP_SET_FIELD: {
+        ObjInstance* instance = AS_INSTANCE(frame->slots[0]);
+        instance->field_values[READ_INDEX()] = peek(0);
+        write_barrier(instance, peek(0));
+        break;
+      }
       case OP_GET_SUPER: {
         ObjString* name = READ_STRING();
         ObjClass* superclass = AS_CLASS(pop());
@@ -393,6 +732,38 @@ InterpretResult VM::run() {
         }
         break;
       }
+      case OP_GET_METHOD: {
+        if (!IS_INSTANCE(peek(0))) {
+          runtime_error("Only instances have properties.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = AS_INSTANCE(peek(0));
+        ObjString* name = READ_STRING();
+        Value value;
+        if (instance->get_field(name, &value)) {
+          pop();
+          push(value);
+          push(NIL_VAL);
+          break;
+        }
+        if (!instance->klass->methods.get(name, &value)) {
+          runtime_error("Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        push(value);
+        break;
+      }
+      case OP_GET_SUPER_METHOD: {
+        ObjString* name = READ_STRING();
+        ObjClass* superclass = AS_CLASS(pop());
+        Value method;
+        if (!superclass->methods.get(name, &method)) {
+          runtime_error("Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        push(method);
+        break;
+      }
       case OP_EQUAL: {
         Value b = pop();
         Value a = pop();
@@ -406,7 +777,11 @@ InterpretResult VM::run() {
         BINARY_OP(BOOL_VAL, <); 
         break;
       case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+          int64_t b = AS_INT(pop());
+          int64_t a = AS_INT(pop());
+          push(NUMBER_VAL(a + b));
+        } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           double b = AS_NUMBER(pop());
@@ -421,13 +796,41 @@ InterpretResult VM::run() {
       case OP_SUBTRACT: 
         BINARY_OP(NUMBER_VAL, -); 
         break;
-      case OP_MULTIPLY: 
-        BINARY_OP(NUMBER_VAL, *); 
+      case OP_MULTIPLY: {
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+          int64_t b = AS_INT(pop());
+          int64_t a = AS_INT(pop());
+          int64_t result = a * b;
+          if (result == 0 && (a < 0 || b < 0)) push(NUMBER_VAL(-0.0));
+          else push(NUMBER_VAL(result));
+          break;
+        }
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          runtime_error("Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a * b));
         break;
-      case OP_DIVIDE: 
-        BINARY_OP(NUMBER_VAL, /); 
+      }
+      case OP_DIVIDE: {
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          runtime_error("Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a / b));
         break;
+      }
       case OP_INT_DIVIDE: {
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+          int64_t b = AS_INT(pop());
+          int64_t a = AS_INT(pop());
+          push(NUMBER_VAL(a / b));
+          break;
+        }
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
           runtime_error("Operands must be numbers.");
           return INTERPRET_RUNTIME_ERROR;
@@ -447,16 +850,74 @@ InterpretResult VM::run() {
         push(NUMBER_VAL(pow(a, b)));
         break;
       }
+      case OP_BIT_AND: 
+        BITWISE_OP(&); 
+        break;
+      case OP_BIT_OR: 
+        BITWISE_OP(|); 
+        break;
+      case OP_BIT_XOR: 
+        BITWISE_OP(^); 
+        break;
+      case OP_SHIFT_LEFT: {
+        int64_t a, b;
+        if (!as_integer(peek(1), &a) || !as_integer(peek(0), &b)) {
+          runtime_error("Operands must be integers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (b < 0) {
+          runtime_error("Shift count must not be negative.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        int64_t result = b < 64 ? static_cast<int64_t>(static_cast<uint64_t>(a) << b) : 0;
+        if ((b < 64 ? (result >> b) != a : a != 0) || result > MAX_SAFE_INTEGER || result < -MAX_SAFE_INTEGER) {
+          runtime_error("Shift result is out of integer range.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        pop();
+        pop();
+        push(NUMBER_VAL(result));
+        break;
+      }
+      case OP_SHIFT_RIGHT: {
+        int64_t a, b;
+        if (!as_integer(peek(1), &a) || !as_integer(peek(0), &b)) {
+          runtime_error("Operands must be integers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (b < 0) {
+          runtime_error("Shift count must not be negative.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        pop();
+        pop();
+        push(NUMBER_VAL(a >> (b < 64 ? b : 63)));
+        break;
+      }
       case OP_NOT:
         push(BOOL_VAL(is_falsey(pop())));
         break;
       case OP_NEGATE:
+        if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0) {
+          push(NUMBER_VAL(-static_cast<int64_t>(AS_INT(pop()))));
+          break;
+        }
         if (!IS_NUMBER(peek(0))) {
           runtime_error("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
         break;
+      case OP_BIT_NOT: {
+        int64_t a;
+        if (!as_integer(peek(0), &a)) {
+          runtime_error("Operand must be an integer.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        pop();
+        push(NUMBER_VAL(~a));
+        break;
+      }
       case OP_PRINT: {
         print_value(pop());
         printf("\n");
@@ -472,9 +933,144 @@ InterpretResult VM::run() {
         if (is_falsey(peek(0))) frame->ip += offset;
         break;
       }
+      case OP_JUMP_LONG: {
+        Chunk* chunk = &frame->closure->function->chunk;
+        uint16_t index = READ_SHORT();
+        frame->ip = chunk->code + AS_INT(chunk->jump_targets.values[index]);
+        break;
+      }
+      case OP_JUMP_IF_FALSE_LONG: {
+        Chunk* chunk = &frame->closure->function->chunk;
+        uint16_t index = READ_SHORT();
+        if (is_falsey(peek(0))) frame->ip = chunk->code + AS_INT(chunk->jump_targets.values[index]);
+        break;
+      }
+      case OP_SWITCH_TABLE: {
+        Value value = pop();
+        uint8_t* table = frame->ip;
+        int32_t low = static_cast<int32_t>(
+          (static_cast<uint32_t>(table[0]) << 24) | (table[1] << 16) | (table[2] << 8) | table[3]
+        );
+        int span = (table[4] << 16) | (table[5] << 8) | table[6];
+        uint8_t* entry = table + 7;
+        if (IS_INT(value)) {
+          int64_t index = static_cast<int64_t>(AS_INT(value)) - low;
+          if (index >= 0 && index < span) entry += 3 + 3 * index;
+        }
+        frame->ip = table + 10 + 3 * span + ((entry[0] << 16) | (entry[1] << 8) | entry[2]);
+        break;
+      }
+      case OP_SWITCH_MAP: {
+        Map* targets = &static_cast<ObjNativeMap*>(AS_OBJ(READ_CONSTANT()))->map;
+        uint32_t offset = READ_LONG();
+        Value value = pop();
+        Value target;
+        if (!IS_NIL(value) && targets->get(value, &target)) {
+          frame->ip += AS_INT(target);
+        } else {
+          frame->ip += offset;
+        }
+        break;
+      }
       case OP_LOOP: {
         uint16_t offset = READ_SHORT();
         frame->ip -= offset;
+        SAFEPOINT();
+        break;
+      }
+      case OP_LOOP_LONG: {
+        uint32_t offset = READ_LONG();
+        frame->ip -= offset;
+        SAFEPOINT();
+        break;
+      }
+      case OP_FOR_PREP: {
+        int arg_count = READ_BYTE();
+        uint32_t offset = READ_LONG();
+        if (arg_count == 1) {
+          push(peek(0));
+          stack_top[-2] = INT_VAL(0);
+        }
+        if (arg_count < 3) push(INT_VAL(1));
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)) || !IS_NUMBER(peek(2))) {
+          runtime_error("Range arguments must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double step = AS_NUMBER(peek(0));
+        if (step == 0) {
+          runtime_error("Range step can't be zero.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double start = AS_NUMBER(peek(2));
+        double end = AS_NUMBER(peek(1));
+        if (step > 0 ? start >= end : start <= end) frame->ip += offset;
+        break;
+      }
+      case OP_ITER_INIT: {
+        if (!iter_init(READ_BYTE())) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &frames[frame_count - 1];
+        break;
+      }
+      case OP_ITER_NEXT:
+      case OP_ITER_NEXT_LONG: {
+        Value* base = &frame->slots[READ_INDEX()];
+        int var_count = READ_BYTE();
+        uint32_t offset = instruction == OP_ITER_NEXT_LONG ? READ_LONG() : READ_SHORT();
+        if (IS_NATIVE_INSTANCE(base[0])) {
+          if (iter_native(base, var_count)) {
+            frame->ip -= offset;
+            SAFEPOINT();
+          } else {
+            push(NIL_VAL);
+          }
+          break;
+        }
+        push(base[1]);
+        if (!invoke(next_string, 0)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &frames[frame_count - 1];
+        SAFEPOINT();
+        break;
+      }
+      case OP_ITER_VALUE:
+      case OP_ITER_VALUE_LONG: {
+        Value* base = &frame->slots[READ_INDEX()];
+        uint32_t offset = instruction == OP_ITER_VALUE_LONG ? READ_LONG() : READ_SHORT();
+        Value value = pop();
+        if (!IS_NIL(value)) {
+          base[2] = value;
+          frame->ip -= offset;
+          SAFEPOINT();
+        }
+        break;
+      }
+      case OP_FOR_RANGE:
+      case OP_FOR_RANGE_LONG: {
+        Value* counter = &frame->slots[READ_INDEX()];
+        uint32_t offset = instruction == OP_FOR_RANGE_LONG ? READ_LONG() : READ_SHORT();
+        if (IS_INT(counter[0]) && IS_INT(counter[1]) && IS_INT(counter[2])) {
+          int64_t next = static_cast<int64_t>(AS_INT(counter[0])) + AS_INT(counter[2]);
+          if (AS_INT(counter[2]) > 0 ? next < AS_INT(counter[1]) : next > AS_INT(counter[1])) {
+            counter[0] = INT_VAL(next);
+            frame->ip -= offset;
+            SAFEPOINT();
+          }
+          break;
+        }
+        if (!IS_NUMBER(counter[0])) {
+          runtime_error("Range counter must be a number.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double step = AS_NUMBER(counter[2]);
+        double next = AS_NUMBER(counter[0]) + step;
+        if (step > 0 ? next < AS_NUMBER(counter[1]) : next > AS_NUMBER(counter[1])) {
+          counter[0] = NUMBER_VAL(next);
+          frame->ip -= offset;
+          SAFEPOINT();
+        }
         break;
       }
       case OP_CALL: {
@@ -483,6 +1079,7 @@ InterpretResult VM::run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         frame = &frames[frame_count - 1];
+        SAFEPOINT();
         break;
       }
       case OP_INVOKE: {
@@ -492,6 +1089,7 @@ InterpretResult VM::run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         frame = &frames[frame_count - 1];
+        SAFEPOINT();
         break;
       }
       case OP_SUPER_INVOKE: {
@@ -502,21 +1100,46 @@ InterpretResult VM::run() {
           return INTERPRET_RUNTIME_ERROR;
         }
         frame = &frames[frame_count - 1];
+        SAFEPOINT();
+        break;
+      }
+      case OP_CALL_METHOD: {
+        // The callee slot holds the receiver and the local at slot holds 
+        // the method found by OP_GET_METHOD, or nil if it found a field.
+        uint16_t slot = READ_INDEX();
+        int arg_count = READ_BYTE();
+        Value method = frame->slots[slot];
+        bool ok = IS_NIL(method) ? call_value(peek(arg_count), arg_count) : call(AS_CLOSURE(method), arg_count);
+        if (!ok) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &frames[frame_count - 1];
+        SAFEPOINT();
         break;
       }
       case OP_CLOSURE: {
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = new ObjClosure(function, make_upvalue_array(function->upvalue_count));
+        ObjClosure* closure = new (function) ObjClosure(function);
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalue_count; i++) {
-          uint8_t is_local = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (is_local) {
+          uint8_t flags = READ_BYTE();
+          uint16_t index = (flags & 2) ? READ_SHORT() : READ_BYTE();
+          if (flags & 1) {
             closure->upvalues[i] = capture_upvalue(frame->slots + index);
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
         }
+        for (int i = 0; i < closure->capture_count; i++) {
+          uint8_t flags = READ_BYTE();
+          uint16_t index = (flags & 2) ? READ_SHORT() : READ_BYTE();
+          if (flags & 1) {
+            closure->captures[i] = frame->slots[index];
+          } else {
+            closure->captures[i] = frame->closure->captures[index];
+          }
+        }
+        write_barrier_all(closure);
         break;
       }
       case OP_CLOSE_UPVALUE:
@@ -534,6 +1157,7 @@ InterpretResult VM::run() {
         stack_top = frame->slots;
         push(result);
         frame = &frames[frame_count - 1];
+        SAFEPOINT();
         break;
       }
       case OP_CLASS:
@@ -547,19 +1171,47 @@ InterpretResult VM::run() {
         }
         ObjClass* subclass = AS_CLASS(peek(0));
         table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+        table_add_all(&AS_CLASS(superclass)->field_slots, &subclass->field_slots);
+        subclass->field_count = AS_CLASS(superclass)->field_count;
+        write_barrier_all(subclass);
         pop(); 
         break;
       }
       case OP_METHOD:
         define_method(READ_STRING());
         break;
+      case OP_FIELD:
+        define_field(READ_STRING());
+        break;
+      case OP_BUILD_LIST:
+        if (!build_list(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+        break;
+      case OP_EXTEND_LIST:
+        if (!extend_list(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+        break;
+      case OP_BUILD_MAP:
+        if (!build_map(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+        break;
+      case OP_EXTEND_MAP:
+        if (!extend_map(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+        break;
+      case OP_BUILD_STRING:
+        build_string(READ_BYTE());
+        break;
+      case OP_WIDE:
+        wide = true;
+        break;
     }
   }
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_INDEX
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef SAFEPOINT
 #undef BINARY_OP
+#undef BITWISE_OP
 }
 
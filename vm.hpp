@@ -7,6 +7,14 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// A function using every local it is allowed still leaves half the stack
+// for its callers.
+#define LOCALS_MAX (STACK_MAX / 2)
+// Size classes up to 4 KiB, then one for each count of cells from 15 down 
+// to 2 that fits in a page.
+#define SMALL_CLASS_COUNT 31
+#define SIZE_CLASS_COUNT (SMALL_CLASS_COUNT + 14)
+#define LARGE_CLASS SIZE_CLASS_COUNT
 
 enum InterpretResult {
   INTERPRET_OK,
@@ -14,6 +22,24 @@ enum InterpretResult {
   INTERPRET_RUNTIME_ERROR
 };
 
+enum GCPhase {
+  GC_IDLE,
+  GC_MARK,
+  GC_CONCURRENT,
+  GC_SWEEP
+};
+
+struct Page;
+
+// The old generation's pages, by size class. Objects too big for any class 
+// get a page each, kept under LARGE_CLASS. While a cycle is being swept, 
+// pages wait on unswept until the sweep or an allocation gets to them.
+struct SizeClass {
+  Page* available;
+  Page* full;
+  Page* unswept;
+};
+
 struct CallFrame {
   ObjClosure* closure;
   uint8_t* ip;
@@ -30,11 +56,44 @@ struct VM {
   ObjUpvalue* open_upvalues;
   size_t bytes_allocated;
   size_t next_gc;
-  Obj* objects;
+  size_t heap_min;
+  size_t heap_max;
+  double heap_grow_factor;
+  bool heap_exhausted;
+  void* memory_reserve;
+  SizeClass size_classes[SIZE_CLASS_COUNT + 1];
+  Page* free_pages;
+  int free_page_count;
+  GCPhase gc_phase;
+  int gc_step_work;
+  int gc_threads;
+  bool sweep_condemned;
+  int marker_pid;
+  int marker_fd;
+  size_t condemned_bytes;
+  size_t condemned_capacity;
+  Obj** condemned;
+  int revived_count;
+  int revived_capacity;
+  Obj** revived;
   int gray_count;
   int gray_capacity;
   Obj** gray_stack;
+  char* nursery;
+  char* nursery_top;
+  uint64_t* nursery_marks;
+  bool gc_request;
+  bool compact_request;
+  int remembered_count;
+  int remembered_capacity;
+  Obj** remembered;
   bool had_native_error;
+  ObjString* list_class;
+  ObjString* list_field;
+  ObjString* map_class;
+  ObjString* map_field;
+  ObjString* iter_string;
+  ObjString* next_string;
 
   VM();
   InterpretResult interpret(const char* source);
@@ -52,7 +111,16 @@ struct VM {
   ObjUpvalue* capture_upvalue(Value* local);
   void close_upvalues(Value* last);
   void define_method(ObjString* name);
+  void define_field(ObjString* name);
   void define_native(const char* name, NativeFn function);
+  bool wrap_literal(ObjString* class_name, ObjString* field_name);
+  ObjNativeInstance* literal_storage(Value literal, ObjString* field_name, NativeType type);
+  bool build_list(int count);
+  bool extend_list(int count);
+  bool build_map(int count);
+  bool extend_map(int count);
+  void build_string(int count);
+  bool iter_init(int var_count);
   void concatenate();
   InterpretResult run();
 };